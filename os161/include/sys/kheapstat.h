@@ -0,0 +1,14 @@
+#ifndef _SYS_KHEAPSTAT_H_
+#define _SYS_KHEAPSTAT_H_
+
+/*
+ * Get struct kheapstat from the kernel
+ */
+#include <kern/kheapstat.h>
+
+/*
+ * kheapstat fills in buf with the kernel heap's usage counters.
+ */
+int kheapstat(struct kheapstat *buf);
+
+#endif /* _SYS_KHEAPSTAT_H_ */
@@ -0,0 +1,30 @@
+#ifndef _SYS_MMAN_H_
+#define _SYS_MMAN_H_
+
+/*
+ * Get the PROT_* flags from the kernel
+ */
+#include <kern/mman.h>
+
+/*
+ * mmap maps length bytes of the file named by path, starting at
+ * offset (which must be a multiple of the page size), somewhere in
+ * the address space and returns the address, or MAP_FAILED. There is
+ * no open file table in OS/161, so the file is named by its path
+ * rather than by a file handle. Each process has its own copy of the
+ * pages it maps: changes made through a writable mapping are written
+ * back to the file, and so seen by other processes mapping or reading
+ * it, only when the page is evicted, on msync, on munmap and on exit.
+ * The part of a mapping past the end of the file reads as zero and is
+ * never written back; mapping a file doesn't make it any longer.
+ * Devices can't be mapped.
+ *
+ * munmap removes the mapping at addr, which must be one mmap returned,
+ * length bytes long. msync writes back the changed pages of the
+ * mapping in [addr, addr+length).
+ */
+void *mmap(const char *path, size_t length, int prot, off_t offset);
+int munmap(void *addr, size_t length);
+int msync(void *addr, size_t length);
+
+#endif /* _SYS_MMAN_H_ */
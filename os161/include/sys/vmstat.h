@@ -0,0 +1,15 @@
+#ifndef _SYS_VMSTAT_H_
+#define _SYS_VMSTAT_H_
+
+/*
+ * Get struct vmstat from the kernel
+ */
+#include <kern/vmstat.h>
+
+/*
+ * vmstat fills in buf with the memory use of the calling process
+ * and of the system as a whole.
+ */
+int vmstat(struct vmstat *buf);
+
+#endif /* _SYS_VMSTAT_H_ */
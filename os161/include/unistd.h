@@ -22,6 +22,11 @@
  *     fstat:    sys/stat.h
  *     lstat:    sys/stat.h
  *     mkdir:    sys/stat.h
+ *     vmstat:   sys/vmstat.h
+ *     mmap:     sys/mman.h
+ *     munmap:   sys/mman.h
+ *     msync:    sys/mman.h
+ *     kheapstat: sys/kheapstat.h
  *
  * If this were standard Unix, more prototypes would go in other
  * header files as well, as follows:
@@ -122,6 +127,8 @@ time_t __time(time_t *seconds, unsigned long *nanoseconds);
 int __getcwd(char *buf, size_t buflen);
 /* stat - see sys/stat.h */
 /* lstat - see sys/stat.h */
+/* vmstat - see sys/vmstat.h */
+/* mmap, munmap, msync - see sys/mman.h */
 
 /*
  * These are not themselves system calls, but wrapper routines in libc.
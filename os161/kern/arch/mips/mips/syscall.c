@@ -107,6 +107,26 @@ mips_syscall(struct trapframe *tf)
  		case SYS_sbrk:
  		err = sys_sbrk(tf->tf_a0, &retval);
  		break;
+
+ 		case SYS_vmstat:
+ 		err = sys_vmstat((userptr_t)tf->tf_a0);
+ 		break;
+
+ 		case SYS_mmap:
+ 		err = sys_mmap((userptr_t)tf->tf_a0, tf->tf_a1, tf->tf_a2, tf->tf_a3, &retval);
+ 		break;
+
+ 		case SYS_munmap:
+ 		err = sys_munmap(tf->tf_a0, tf->tf_a1);
+ 		break;
+
+ 		case SYS_msync:
+ 		err = sys_msync(tf->tf_a0, tf->tf_a1);
+ 		break;
+
+ 		case SYS_kheapstat:
+ 		err = sys_kheapstat((userptr_t)tf->tf_a0);
+ 		break;
  		
 	    default:
 		//kprintf("Unknown syscall %d\n", callno);
@@ -153,7 +173,7 @@ void md_forkentry(struct trapframe *tf, struct addrspace * as){
 
 	struct trapframe new_tf;
 	memcpy(&new_tf, tf, sizeof(struct trapframe));
-	kfree(tf);
+	kmem_cache_free(trapframe_cache, tf);
 
 	// 2) copy the parent's address space
 	curthread->t_vmspace = as;
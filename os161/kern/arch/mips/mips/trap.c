@@ -197,6 +197,14 @@ mips_trap(struct trapframe *tf)
 	panic("I can't handle this... I think I'll just die now...\n");
 
  done:
+	/*
+	 * A process the OOM killer picked exits here, on its way back
+	 * to user mode, rather than wherever it happened to be.
+	 */
+	if (!iskern) {
+		oom_check();
+	}
+
 	/* Make sure interrupts are off */
 	splhigh();
 
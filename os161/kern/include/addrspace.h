@@ -16,20 +16,44 @@ struct vnode;
  * You write this.
  */
 
+/*
+ * Page table entry. Each address space has a two-level page table
+ * indexed by virtual page number: the top 10 bits of a user address
+ * select a second-level table, the next 10 bits select the pte within
+ * it. Second-level tables are only allocated once a page in their 4M
+ * range is touched, so a sparse address space only pays for the pages
+ * it maps. An all-zero pte means the page was never touched.
+ */
 struct pte{
-	paddr_t pa;
-	vaddr_t va;
-	short rwx;
-	short on_mem;
-	short on_disk;
-	struct pte *next;
+	u_int32_t pfn:20;		//physical frame number (pa / PAGE_SIZE) while on_mem, swap slot while on_disk
+	u_int32_t rwx:3;		//PF_R | PF_W | PF_X of the region the page belongs to
+	u_int32_t on_mem:1;
+	u_int32_t on_disk:1;
+	u_int32_t super:1;		//mapped as part of a superpage chunk (see super_fill in vm.c)
 };
 
+#define PTE_PA(pte)		((paddr_t)(pte)->pfn * PAGE_SIZE)
+#define PTE_SET_PA(pte, pa)	((pte)->pfn = (pa) / PAGE_SIZE)
+
+#define PT_L1_SHIFT	22
+#define PT_L2_SHIFT	12
+#define PT_L2_ENTRIES	(PAGE_SIZE / sizeof(struct pte))
+#define PT_L1_ENTRIES	(USERTOP >> PT_L1_SHIFT)
+#define PT_L1_INDEX(va)	((va) >> PT_L1_SHIFT)
+#define PT_L2_INDEX(va)	(((va) >> PT_L2_SHIFT) & (PT_L2_ENTRIES - 1))
+#define PT_VADDR(l1, l2)	(((vaddr_t)(l1) << PT_L1_SHIFT) | ((vaddr_t)(l2) << PT_L2_SHIFT))
+
 struct region_array{
 	paddr_t pa;
 	vaddr_t va;
 	short rwx;
 	size_t num_pages;
+	struct vnode *vn;	//executable the segment is paged in from, NULL if it is all zero
+	off_t offset;		//file offset of the segment
+	vaddr_t file_va;	//where the segment starts (need not be page aligned)
+	size_t filesize;	//bytes of the segment in the file, the rest of it is zero
+	int super;		//large enough for its zero-filled chunks to be backed by superpages
+	int mapped;		//a file mapped by sys_mmap: dirty pages are written back to vn, not to swap
 	struct region_array *next;
 };
 
@@ -44,19 +68,28 @@ struct addrspace {
 	paddr_t as_stackpbase;
 #else
 	/* Put stuff here for your VM system */
-	struct pte *pages;
-	struct pte *last_page;
-	
-	struct pte *stack;
-	struct pte *last_stack;
-	vaddr_t stack_begin, stack_end;
+	struct pte **pt;	//level 1 page table: PT_L1_ENTRIES pointers to level 2 tables
 
-	struct pte *heap;
-	struct pte *last_heap;
+	u_int32_t asid;			//TLB address space ID, valid while asid_gen is current
+	unsigned long asid_gen;
+
+	vaddr_t stack_begin, stack_end;
 	vaddr_t heap_begin, heap_end;
+	vaddr_t mmap_base;	//lowest mapped file; sys_mmap places mappings below it, sbrk stops short of it
 
 	struct region_array *regions;
 	struct region_array *last_region;
+	int superpages;		//back large regions and the heap with superpages (vm_superpages at creation)
+
+	/* memory use, reported by sys_vmstat and the vms menu command */
+	unsigned long rss;		//resident pages mapped by the page table
+	unsigned long minflt;		//faults resolved without any I/O
+	unsigned long majflt;		//faults that read the page from swap or the executable
+	unsigned long swapins;		//pages read back from swap
+	unsigned long swapouts;		//pages written out to swap
+	unsigned long swapped;		//pages mapped by the page table that are in swap
+
+	unsigned long reserved;		//pages charged against vm_commit_limit (see vm/oom.c)
 
 #endif
 };
@@ -64,6 +97,9 @@ struct addrspace {
 /*
  * Functions in addrspace.c:
  *
+ *    as_bootstrap - set up the caches address spaces and page tables
+ *                come from. Called by vm_bootstrap.
+ *
  *    as_create - create a new empty address space. You need to make 
  *                sure this gets called in all the right places. You
  *                may find you want to change the argument list. May
@@ -84,6 +120,9 @@ struct addrspace {
  *    as_define_region - set up a region of memory within the address
  *                space.
  *
+ *    as_define_file - record that a region is backed by a segment of an
+ *                executable. Its pages are read in on first touch.
+ *
  *    as_prepare_load - this is called before actually loading from an
  *                executable into the address space.
  *
@@ -95,9 +134,9 @@ struct addrspace {
  *                back the initial stack pointer for the new process.
  */
 
+void              as_bootstrap(void);
 struct addrspace *as_create(void);
-//int               as_copy(struct addrspace *src, struct addrspace **ret);
-int 				as_copy(volatile struct addrspace *old, volatile struct addrspace **ret);
+int               as_copy(struct addrspace *src, struct addrspace **ret);
 void              as_activate(struct addrspace *);
 void              as_destroy(struct addrspace *);
 
@@ -106,20 +145,42 @@ int               as_define_region(struct addrspace *as,
 				   int readable, 
 				   int writeable,
 				   int executable);
+int		  as_define_file(struct addrspace *as, struct vnode *v,
+				 off_t offset, vaddr_t vaddr,
+				 size_t memsize, size_t filesize);
 int		  as_prepare_load(struct addrspace *as);
 int		  as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
 
 
+/*
+ * Page table functions in addrspace.c:
+ *
+ *    pt_lookup - return the pte for VA, allocating the level 2 table
+ *                if CREATE is set. Returns NULL if there is no such
+ *                pte (or no memory for the level 2 table).
+ *
+ *    pt_clear_range - release the frames mapped in [START, END) and
+ *                zero their ptes.
+ *
+ *    region_charge - the pages of a region that are reserved against
+ *                the commit limit (see vm/oom.c).
+ */
+struct pte *pt_lookup(struct addrspace *as, vaddr_t va, int create);
+void pt_clear_range(struct addrspace *as, vaddr_t start, vaddr_t end);
+unsigned long region_charge(struct region_array *region);
+
 // from vm.c
-paddr_t demand_page(struct pte *entry, struct addrspace *as);
-paddr_t load_page(struct pte *entry, struct addrspace *as, int faulttype);
-unsigned long find_lru();
-unsigned long get_space_on_disk(unsigned long index, vaddr_t faultaddress, swap_type_t swap_type);
-void swap_out(unsigned long offset,vaddr_t va);
-void swap_in(unsigned long offset, vaddr_t va);
-struct pte * update_pte(unsigned long index);
+int demand_page(struct pte *entry, struct addrspace *as, vaddr_t va, paddr_t *ret);
+int load_page(struct pte *entry, struct addrspace *as, vaddr_t va, paddr_t *ret);
+int page_share(struct pte *old, struct pte *new, struct addrspace *as, vaddr_t va);
+void page_release(struct addrspace *as, vaddr_t va, struct pte *entry);
+int swap_out(unsigned long offset,vaddr_t va);
+int swap_in(unsigned long offset, vaddr_t va);
 void update_cmap(unsigned long index, struct addrspace *as, cmap_state_t state, page_state_t pstate);
+void free_all_pages(struct addrspace *as);
+struct region_array *mapped_region(struct addrspace *as, vaddr_t va);
+int mmap_sync(struct addrspace *as, struct region_array *region, vaddr_t start, vaddr_t end);
 
 /*
  * Functions in loadelf.c
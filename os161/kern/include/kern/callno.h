@@ -40,6 +40,11 @@
 #define SYS___getcwd     29
 #define SYS_stat         30
 #define SYS_lstat        31
+#define SYS_vmstat       32
+#define SYS_mmap         33
+#define SYS_munmap       34
+#define SYS_msync        35
+#define SYS_kheapstat    36
 /*CALLEND*/
 
 
@@ -0,0 +1,41 @@
+#ifndef _KERN_KHEAPSTAT_H_
+#define _KERN_KHEAPSTAT_H_
+
+/*
+ * Structure for kheapstat (call to get kernel heap usage information)
+ *
+ * Allocation counts are totals since boot; kh_secs and kh_nsecs say
+ * when they were taken, so two calls give allocation rates. Call
+ * sites are only reported by kernels built with the kheapstats
+ * option. Sizes are in bytes unless noted.
+ */
+
+#define KHS_NSIZES	8	/* kmalloc size classes */
+#define KHS_NSITES	32	/* most call sites reported */
+
+struct kheapstat_site {
+	u_int32_t ks_caller;	/* address kmalloc was called from */
+	u_int32_t ks_bytes;	/* held in blocks it allocated */
+	u_int32_t ks_peak;	/* most it ever held */
+	u_int32_t ks_allocs;	/* blocks it allocated */
+	u_int32_t ks_frees;	/* of those, freed */
+};
+
+struct kheapstat {
+	u_int32_t kh_secs;		/* time the numbers were taken */
+	u_int32_t kh_nsecs;
+	u_int32_t kh_pagerefpages;	/* pages of page bookkeeping */
+	u_int32_t kh_bigpages;		/* pages of blocks bigger than a size class */
+
+	/* per size class */
+	u_int32_t kh_size[KHS_NSIZES];	/* block size */
+	u_int32_t kh_sizepages[KHS_NSIZES]; /* pages of blocks that size */
+	u_int32_t kh_hits[KHS_NSIZES];	/* kmallocs that found a page with room */
+	u_int32_t kh_misses[KHS_NSIZES]; /* kmallocs that needed a new page */
+
+	/* the call sites holding the most, most first */
+	u_int32_t kh_nsites;
+	struct kheapstat_site kh_sites[KHS_NSITES];
+};
+
+#endif /* _KERN_KHEAPSTAT_H_ */
@@ -0,0 +1,13 @@
+#ifndef _KERN_MMAN_H_
+#define _KERN_MMAN_H_
+
+/*
+ * Protection flags for mmap()
+ */
+
+#define PROT_READ   1	/* pages can be read */
+#define PROT_WRITE  2	/* pages can be written; changes go back to the file */
+
+#define MAP_FAILED ((void *)-1)	/* returned by mmap on error */
+
+#endif /* _KERN_MMAN_H_ */
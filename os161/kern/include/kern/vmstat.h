@@ -0,0 +1,39 @@
+#ifndef _KERN_VMSTAT_H_
+#define _KERN_VMSTAT_H_
+
+/*
+ * Structure for vmstat (call to get memory usage information)
+ *
+ * The first group of fields describes the calling process, the
+ * second the whole system. Sizes are in pages.
+ */
+
+struct vmstat {
+	/* the calling process */
+	u_int32_t vs_rss;	/* resident pages it has mapped */
+	u_int32_t vs_minflt;	/* faults resolved without any I/O */
+	u_int32_t vs_majflt;	/* faults that read from swap or the executable */
+	u_int32_t vs_swapin;	/* pages read back from swap */
+	u_int32_t vs_swapout;	/* pages written out to swap */
+	u_int32_t vs_swapped;	/* pages it has in swap */
+	u_int32_t vs_reserved;	/* pages it has reserved (see vs_committed) */
+
+	/* the system */
+	u_int32_t vs_pages;	/* physical pages managed by the VM system */
+	u_int32_t vs_free;	/* of those, free */
+	u_int32_t vs_user;	/* of those, holding user pages */
+	u_int32_t vs_swap;	/* swap slots */
+	u_int32_t vs_swapfree;	/* of those, free */
+	u_int32_t vs_tminflt;	/* minor faults */
+	u_int32_t vs_tmajflt;	/* major faults */
+	u_int32_t vs_tswapin;	/* pages read back from swap */
+	u_int32_t vs_tswapout;	/* pages written out to swap */
+	u_int32_t vs_swapios;	/* requests sent to the swap disk */
+	u_int32_t vs_evictions;	/* pages evicted */
+	u_int32_t vs_tlbmisses;	/* TLB misses */
+	u_int32_t vs_committed;	/* pages reserved by all processes */
+	u_int32_t vs_commitlimit; /* most that can be reserved: RAM and swap */
+	u_int32_t vs_oomkills;	/* processes killed because memory ran out */
+};
+
+#endif /* _KERN_VMSTAT_H_ */
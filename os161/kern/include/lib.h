@@ -87,10 +87,30 @@ u_int32_t random(void);
 /*
  * Kernel heap memory allocation. Like malloc/free.
  * If out of memory, kmalloc returns NULL.
+ *
+ * kheap_printstats prints the heap's counters, and a map of every
+ * page of small blocks if PAGEMAPS is set. kheap_getstat fills in the
+ * same counters for the kheapstat system call.
  */
+struct kheapstat;
 void *kmalloc(size_t sz);
 void kfree(void *ptr);
-void kheap_printstats(void);
+void kheap_printstats(int pagemaps);
+void kheap_getstat(struct kheapstat *ks);
+
+/*
+ * Object caches: allocators for objects of one exact size, for the
+ * structures the kernel allocates and frees all the time. CTOR, if not
+ * NULL, is run on each object once when the cache first gets its
+ * memory; objects must be freed in their constructed state. NAME is
+ * only used by kheap_printstats and must stay around. Like kmalloc,
+ * kmem_cache_alloc returns NULL when out of memory.
+ */
+struct kmem_cache;
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+				     void (*ctor)(void *obj));
+void *kmem_cache_alloc(struct kmem_cache *kc);
+void kmem_cache_free(struct kmem_cache *kc, void *ptr);
 
 /*
  * C string functions. 
@@ -30,6 +30,11 @@ struct sfs_fs {
 	int sfs_freemapdirty;           /* true if freemap modified */
 };
 
+/*
+ * Where struct sfs_vnodes come from. Created by the first mount.
+ */
+extern struct kmem_cache *sfs_vnode_cache;
+
 /*
  * Function for mounting a sfs (calls vfs_mount)
  */
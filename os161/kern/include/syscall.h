@@ -19,6 +19,11 @@ void sys__exit(int exitcode);
 
 int sys_fork(struct trapframe *tf, int *retval);
 
+/* sets up trapframe_cache, where sys_fork gets the child's trapframe */
+struct kmem_cache;
+extern struct kmem_cache *trapframe_cache;
+void fork_bootstrap(void);
+
 int sys_waitpid(int pid, int *status, int options, int *retval);
 
 int sys_read(int fd, void *buf, size_t nbytes, int *retval);
@@ -31,5 +36,15 @@ int sys_execv(const char *program, char **args);
 
 int sys_sbrk(intptr_t amount, int *retval);
 
+int sys_vmstat(userptr_t buf);
+
+int sys_mmap(userptr_t path, size_t length, int prot, off_t offset, int *retval);
+
+int sys_munmap(vaddr_t addr, size_t length);
+
+int sys_msync(vaddr_t addr, size_t length);
+
+int sys_kheapstat(userptr_t buf);
+
 #endif /* _SYSCALL_H_ */
 
@@ -15,6 +15,7 @@
 	int ppid;					//parent pid
 	int exited;
 	int exit_code;				
+	int killed;					//picked by the OOM killer: exits on its way back to user mode (oom_check)
 	struct thread* p_thread;
 	struct semaphore* exit_semaphore;
  };
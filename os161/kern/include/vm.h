@@ -3,9 +3,20 @@
 
 #include <machine/vm.h>
 
+struct vnode;
+struct vmstat;
+struct addrspace;
+struct pageref;
+
 unsigned long pages_avail;
 unsigned long smap_pages_avail;
 
+extern struct cmap_entry *cmap;
+extern int vm_bootstrap_done;
+extern unsigned long page_count;
+extern unsigned long smap_page_count;
+extern paddr_t cmap_start_physaddr;
+
 typedef enum {
 	freed,
 	fixed,
@@ -23,20 +34,14 @@ typedef enum {
 	user
 } page_state_t;
 
-typedef enum{
-	SWAPIN,
-	SWAPOUT
-} swap_type_t;
-
-
-#define EVICT_CLEAN 1
-#define EVICT_DIRTY 1
 
 /*
-	cmap state can either be freed, fixed or occupied
+	cmap state can either be freed, fixed, dirty or clean. A clean user page is identical to
+	the copy in its swap slot, so evicting it needs no write
 */
 struct cmap_entry{
 	struct addrspace *as;
+	vaddr_t va;			//user virtual address the page is mapped at in as
 	paddr_t pa;
 	cmap_state_t state;
 	int first_page;
@@ -44,18 +49,128 @@ struct cmap_entry{
 	time_t s;
 	u_int32_t ns;
 	page_state_t p_state;
+	int next_free;		//free list links (coremap indices), valid while freed
+	int prev_free;
+	int refcount;		//number of ptes mapping the page: more than one after a fork (copy-on-write)
+	struct cmap_sharer *sharers;	//the mappings other than (as, va)
+	int swap_slot;		//swap slot still holding a copy of the page, or NO_SLOT
+	int busy;			//pinned for I/O or a copy, by this many threads: not evictable
+	int zeroed;			//freed page that is already cleared (on the zeroed free list)
+	struct vnode *pc_vn;	//executable the page is cached for (see vm/pagecache.c), or NULL
+	int pc_next;		//next page in the same page cache bucket
+	int referenced;		//software reference bit, set when vm_fault maps the page
+	unsigned long last_used;	//vm_vtime when the page was last seen referenced
+	struct pageref *pageref;	//kernel heap page split into small blocks: its bookkeeping (see lib/kheap.c)
+	int kmsite;			//first page of a big kmalloc block: its call site plus one, 0 if not counted
 };
 
+/*
+	a mapping of a shared page, besides the one in cmap[].as/va
+*/
+struct cmap_sharer{
+	struct addrspace *as;
+	vaddr_t va;
+	struct cmap_sharer *next;
+};
+
+#define NO_PAGE (-1)
+#define NO_SLOT (-1)
+
+/* a swapped out pte keeps its slot in the 20 bit pfn field */
+#define SWAP_MAX_SLOTS (1 << 20)
+
+/* coremap index of a managed physical address, in constant time */
+#define PADDR_TO_CMAP_INDEX(paddr) (((paddr) - cmap_start_physaddr) / PAGE_SIZE)
+
 /*
 	smap state can either be freed or occupied
 */
 struct smap_entry{
 	unsigned long disk_pa;
-	struct addrspace *as;
-	vaddr_t va;
 	smap_state_t state;
+	int refcount;		//ptes and frames that use this slot
+	int writing;		//a write to the slot is in flight (see swap_write_begin)
+	int bad;			//a write to the slot failed: what it held is lost, and it is never reused
+};
+
+/*
+	coremap lock (see vm/vm.c). It protects the coremap, the swap map and the resident/on disk
+	state of every pte. The holder may take it again
+*/
+void cmap_lock(void);
+void cmap_unlock(void);
+int cmap_lock_held(void);
+
+/*
+	pageout daemon (see vm/pageout.c). It is woken when free memory falls below the low
+	watermark and pages out until the high watermark is reached. The pool of zeroed pages is
+	filled by vm_idle_zero from the idle loop, a page per pass
+*/
+#define PAGEOUT_MIN_USER 8		//leave at least this many user pages resident
+
+extern int user_pages;
+extern unsigned long cmap_zeroed_pages;
+
+void pageout_bootstrap(void);
+void pageout_wakeup(void);
+int vm_pageout_one(void);
+void vm_idle_zero(void);
+
+/* text page cache (see vm/pagecache.c) */
+int pcache_lookup(struct vnode *vn, vaddr_t va);
+void pcache_insert(unsigned long index, struct vnode *vn);
+void pcache_remove(unsigned long index);
+
+/* largest number of pages read or written to swap with one request */
+#define SWAP_CLUSTER 8
+
+extern unsigned long vm_swap_ios;
+extern unsigned long vm_swap_reads;
+extern unsigned long vm_minflt, vm_majflt;
+int page_evictable(unsigned long index);
+
+int swap_alloc(void);
+void swap_ref(int slot);
+void swap_unref(int slot);
+
+
+/*
+	page replacement policy (see vm/replace.c). pp_victim returns the coremap index
+	of a user page to evict, or page_count if there is none. It is called with the
+	coremap lock held (find_victim asserts cmap_lock_held())
+*/
+struct page_policy{
+	const char *pp_name;
+	unsigned long (*pp_victim)(void);
 };
 
+extern unsigned long vm_vtime;		//virtual time, advanced on every vm_fault
+extern unsigned long vm_evictions;	//victims chosen since the policy was selected
+extern unsigned long vm_swap_writes;	//victims that were dirty and had to be written out
+
+/*
+	memory pressure (see vm/oom.c). Address spaces reserve the anonymous memory they may come to
+	need against vm_commit_limit (RAM and swap), so sbrk, fork, exec and mmap fail with ENOMEM
+	rather than promise more than there is. If a fault still can't get a frame, the OOM killer
+	kills the largest process; it exits in oom_check, on its way back to user mode
+*/
+#define COMMIT_KERNEL_SHARE 4	//1/4 of the RAM free at boot is left to the kernel heap
+#define OOM_RETRIES 3		//times a fault asks the OOM killer for memory before it gives up
+
+extern unsigned long vm_committed, vm_commit_limit;
+extern unsigned long vm_oom_kills;
+
+int vm_reserve(struct addrspace *as, unsigned long npages);
+void vm_unreserve(struct addrspace *as, unsigned long npages);
+int oom_kill(void);
+void oom_check(void);
+
+/* fill in vs for as (which may be NULL) and the system as a whole */
+void vm_getstat(struct addrspace *as, struct vmstat *vs);
+
+unsigned long find_victim(void);
+int vm_set_policy(const char *name);
+const char *vm_get_policy(void);
 
 /* Fault-type arguments to vm_fault() */
 #define VM_FAULT_READ        0    /* A read was attempted */
@@ -76,4 +191,30 @@ vaddr_t alloc_upages(int npages, struct addrspace *as);
 
 void free_kpages(vaddr_t addr);
 
+/* Drop any TLB entry that maps the given physical page */
+void tlb_invalidate_pa(paddr_t pa);
+/* Drop the TLB entry for one page, or for all pages, of an address space */
+void tlb_invalidate_va(struct addrspace *as, vaddr_t va);
+void tlb_invalidate_as(struct addrspace *as);
+
+/* TLB fill statistics and prefetch depth (see tlb_load in vm.c) */
+#define TLB_PREFETCH_MAX 8
+extern int tlb_prefetch;
+extern unsigned long tlb_misses, tlb_modfaults, tlb_fastfills, tlb_prefetched;
+
+/*
+	superpages. The r3000 only has 4K pages, so a superpage is a SUPERPAGE_PAGES aligned chunk of
+	zero-filled memory that is backed by a contiguous run of frames, all mapped on the first
+	touch, and whose TLB entries are all loaded by one miss. Address spaces created while
+	vm_superpages is set use them for the regions at least that large and for the heap
+*/
+#define SUPERPAGE_PAGES 16
+#define SUPERPAGE_SIZE (SUPERPAGE_PAGES * PAGE_SIZE)
+extern int vm_superpages;
+extern unsigned long vm_superfills, tlb_rangefills;
+
+/* ASID of the running address space and the current ASID generation (see as_activate) */
+extern u_int32_t cur_asid;
+extern unsigned long asid_generation;
+
 #endif /* _VM_H_ */
@@ -1,8 +1,13 @@
 #include <types.h>
+#include <kern/kheapstat.h>
 #include <lib.h>
+#include <clock.h>
 #include <vm.h>
 #include <machine/spl.h>
+#include "opt-kheapstats.h"
+#include "opt-kheapdebug.h"
 
+#if OPT_KHEAPDEBUG
 static
 void
 fill_deadbeef(void *vptr, size_t len)
@@ -14,6 +19,7 @@ fill_deadbeef(void *vptr, size_t len)
 		ptr[i] = 0xdeadbeef;
 	}
 }
+#endif
 
 ////////////////////////////////////////////////////////////
 //
@@ -69,7 +75,9 @@ struct freelist {
 
 struct pageref {
 	struct pageref *next_samesize;
+	struct pageref **prev_samesize;	/* the pointer that points at us */
 	struct pageref *next_all;
+	struct pageref **prev_all;
 	vaddr_t pageaddr_and_blocktype;
 	u_int16_t freelist_offset;
 	u_int16_t nfree;
@@ -84,74 +92,438 @@ struct pageref {
 ////////////////////////////////////////
 
 /*
- * This is cheesy. 
- *
- * The problem is not that it's wasteful - we can only allocate whole
- * pages of pageref structures at a time anyway. The problem is that
- * we really ought to be able to have more than one of these pages.
+ * Pagerefs live in whole pages of their own, which cannot come from
+ * the subpage allocator itself. The first page of them is in the BSS,
+ * so the heap works before the VM system is up; once it is used up,
+ * more pages are taken with alloc_kpages as the heap grows. A page of
+ * pagerefs describes 170 heap pages, so they are never given back.
  *
- * However, for the time being, one page worth of pagerefs gives us
- * 256 pagerefs; this lets us manage 256 * 4k = 1M of kernel heap.
- * That would be twice as much memory as we get for *everything*.
- * Thus, we will cheat and not allow any mechanism for having a second
- * page of pageref structs.
- *
- * Then, since the size is fixed at one page, we'll simplify a bit
- * further by allocating the page in the kernel BSS instead of calling
- * alloc_kpages to get it.
+ * Unused pagerefs are kept on a free list linked through
+ * next_samesize, which makes getting one and putting it back constant
+ * time.
  */
 
 #define NPAGEREFS (PAGE_SIZE / sizeof(struct pageref))
 static struct pageref pagerefs[NPAGEREFS];
 
-#define INUSE_WORDS (NPAGEREFS/32)
-static u_int32_t pagerefs_inuse[INUSE_WORDS];
+static struct pageref *freepagerefs;
+static unsigned npagerefpages;		/* pages of pagerefs, the BSS one included */
+
+static
+void
+addpagerefs(struct pageref *prs)
+{
+	unsigned i;
+
+	for (i=0; i<NPAGEREFS; i++) {
+		prs[i].next_samesize = freepagerefs;
+		freepagerefs = &prs[i];
+	}
+	npagerefpages++;
+}
 
 static
 struct pageref *
 allocpageref(void)
 {
-	unsigned i,j;
-	u_int32_t k;
+	struct pageref *pr;
+	vaddr_t page;
 
-	for (i=0; i<INUSE_WORDS; i++) {
-		if (pagerefs_inuse[i]==0xffffffff) {
-			/* full */
-			continue;
-		}
-		for (k=1,j=0; k!=0; k<<=1,j++) {
-			if ((pagerefs_inuse[i] & k)==0) {
-				pagerefs_inuse[i] |= k;
-				return &pagerefs[i*32 + j];
-			}
+	if (npagerefpages == 0) {
+		addpagerefs(pagerefs);
+	}
+
+	if (freepagerefs == NULL) {
+		page = alloc_kpages(1);
+		if (page == 0) {
+			return NULL;
 		}
-		assert(0);
+		addpagerefs((struct pageref *)page);
 	}
 
-	/* ran out */
-	return NULL;
+	pr = freepagerefs;
+	freepagerefs = pr->next_samesize;
+	return pr;
 }
 
 static
 void
 freepageref(struct pageref *p)
 {
-	size_t i, j;
-	u_int32_t k;
-
-	j = p-pagerefs;
-	assert(j < NPAGEREFS);  /* note: j is unsigned, don't test < 0 */
-	i = j/32;
-	k = ((u_int32_t)1) << (j%32);
-	assert((pagerefs_inuse[i] & k) != 0);
-	pagerefs_inuse[i] &= ~k;
+	p->next_samesize = freepagerefs;
+	freepagerefs = p;
 }
 
 ////////////////////////////////////////
 
+/*
+ * Pages of each size are on one of two lists: sizebases[] has the ones
+ * with free blocks and fullbases[] the ones without, so kmalloc takes
+ * the first page on sizebases[] instead of walking past full ones.
+ * Pages move between the two as their last block is handed out and
+ * the first one comes back. All pages are on allbase as well.
+ */
 static struct pageref *sizebases[NSIZES];
+static struct pageref *fullbases[NSIZES];
 static struct pageref *allbase;
 
+/*
+ * Counters for kheap_printstats and kheapstat(). A hit is a kmalloc
+ * that found a page of its size with room, a miss one that had to get
+ * a new page.
+ */
+static unsigned sizepages[NSIZES];
+static unsigned long sizehits[NSIZES];
+static unsigned long sizemisses[NSIZES];
+static unsigned bigpages;		/* pages of kmallocs too big for a subpage */
+
+/*
+ * What kmalloc adds to small requests for the options below: room for
+ * the call-site tag, which is the last word of the block, and for the
+ * redzone, which comes right before it. Big blocks get neither, so
+ * that a request of a whole number of pages takes no more pages.
+ */
+#if OPT_KHEAPSTATS
+#define KMTAG_SIZE	sizeof(u_int32_t)
+#else
+#define KMTAG_SIZE	0
+#endif
+
+#if OPT_KHEAPDEBUG
+#define KMRED_MIN	4	/* redzone bytes, at least */
+#define KMRED_SIZE	(KMRED_MIN + sizeof(u_int32_t))
+#else
+#define KMRED_SIZE	0
+#endif
+
+#if OPT_KHEAPSTATS
+/*
+ * Call-site accounting.
+ *
+ * Each small kmalloc'd block ends in a tag naming the place kmalloc
+ * was called from, so kfree can charge the block back to it. kmalloc
+ * asks for KMTAG_SIZE more than the caller did to make room, which
+ * moves requests within a word of the top of a size class up to the
+ * next one. A big block keeps its call site in the coremap entry of
+ * its first page instead (cmap[].kmsite), so it takes no more pages
+ * than it would without the tag.
+ *
+ * Call sites are kept in a small hash table, by return address. When
+ * it is full, further sites are all counted in kmsites[0].
+ *
+ * Besides the accounting, a tag that kfree finds overwritten means
+ * someone wrote past the end of their block.
+ */
+
+#define KMSITES		128
+#define KMTAG_MAGIC	0x6b680000	/* "kh" */
+#define KMTAG_SITE	0x0000ffff
+
+struct kmsite {
+	vaddr_t caller;
+	unsigned long allocs;
+	unsigned long frees;
+	unsigned long bytes;		/* in blocks it holds right now */
+	unsigned long peak;		/* most bytes it ever held */
+	unsigned long lastallocs;	/* allocs as of the previous kh */
+};
+
+static struct kmsite kmsites[KMSITES];
+
+/* when kh last printed allocation rates */
+static time_t kmsites_lastsecs;
+static u_int32_t kmsites_lastnsecs;
+
+static
+unsigned
+kmsite_find(vaddr_t caller)
+{
+	unsigned i, n;
+
+	assert(curspl>0);
+
+	i = 1 + (caller >> 2) % (KMSITES - 1);
+	for (n = 0; n < KMSITES - 1; n++) {
+		if (kmsites[i].caller == caller) {
+			return i;
+		}
+		if (kmsites[i].caller == 0) {
+			kmsites[i].caller = caller;
+			return i;
+		}
+		i = (i == KMSITES - 1) ? 1 : i + 1;
+	}
+	return 0;
+}
+
+/*
+ * Charges BYTES to CALLER's site and returns the site.
+ */
+static
+unsigned
+kmsite_charge(vaddr_t caller, size_t bytes)
+{
+	struct kmsite *ks;
+	unsigned site;
+
+	assert(curspl>0);
+
+	site = kmsite_find(caller);
+	ks = &kmsites[site];
+	ks->allocs++;
+	ks->bytes += bytes;
+	if (ks->bytes > ks->peak) {
+		ks->peak = ks->bytes;
+	}
+	return site;
+}
+
+static
+void
+kmsite_uncharge(unsigned site, size_t bytes)
+{
+	struct kmsite *ks;
+
+	assert(curspl>0);
+	assert(site < KMSITES);
+
+	ks = &kmsites[site];
+	assert(ks->bytes >= bytes);
+	ks->frees++;
+	ks->bytes -= bytes;
+}
+
+static
+void
+kmtag_set(void *block, size_t blocksize, vaddr_t caller)
+{
+	u_int32_t *tag = (u_int32_t *)((vaddr_t)block + blocksize - KMTAG_SIZE);
+	int spl;
+
+	spl = splhigh();
+	*tag = KMTAG_MAGIC | kmsite_charge(caller, blocksize);
+	splx(spl);
+}
+
+static
+void
+kmtag_clear(void *block, size_t blocksize)
+{
+	u_int32_t *tag = (u_int32_t *)((vaddr_t)block + blocksize - KMTAG_SIZE);
+
+	assert(curspl>0);
+
+	if ((*tag & ~KMTAG_SITE) != KMTAG_MAGIC ||
+	    (*tag & KMTAG_SITE) >= KMSITES) {
+		panic("kfree: end of block %p overwritten (0x%x)\n",
+		      block, *tag);
+	}
+
+	kmsite_uncharge(*tag & KMTAG_SITE, blocksize);
+	*tag = 0;
+}
+
+/*
+ * Puts the indexes of up to MAX call sites in ORDER, the ones holding
+ * the most bytes first, and returns how many.
+ */
+static
+unsigned
+kmsites_sort(unsigned *order, unsigned max)
+{
+	unsigned i, j, n = 0;
+
+	assert(curspl>0);
+
+	for (i = 0; i < KMSITES; i++) {
+		if (kmsites[i].allocs == 0) {
+			continue;
+		}
+		for (j = n; j > 0; j--) {
+			if (kmsites[order[j-1]].bytes >= kmsites[i].bytes) {
+				break;
+			}
+			if (j < max) {
+				order[j] = order[j-1];
+			}
+		}
+		if (j < max) {
+			order[j] = i;
+			if (n < max) {
+				n++;
+			}
+		}
+	}
+	return n;
+}
+
+static
+void
+kmsites_printstats(void)
+{
+	static unsigned order[KMSITES];
+	struct kmsite *ks;
+	time_t secs;
+	u_int32_t nsecs, msecs;
+	unsigned i, n;
+
+	assert(curspl>0);
+
+	gettime(&secs, &nsecs);
+	msecs = 0;
+	if (kmsites_lastsecs != 0) {
+		msecs = (secs - kmsites_lastsecs) * 1000 +
+			nsecs / 1000000 - kmsites_lastnsecs / 1000000;
+	}
+
+	kprintf("kmalloc call sites: bytes held, peak, allocs, frees, "
+		"allocs/s since the last kh\n");
+	n = kmsites_sort(order, KMSITES);
+	for (i = 0; i < n; i++) {
+		ks = &kmsites[order[i]];
+		if (order[i] == 0) {
+			kprintf("  (others)  ");
+		}
+		else {
+			kprintf("  0x%08lx", (unsigned long)ks->caller);
+		}
+		kprintf(" %8lu %8lu %8lu %8lu", ks->bytes, ks->peak,
+			ks->allocs, ks->frees);
+		if (msecs > 0) {
+			kprintf(" %8lu\n",
+				(ks->allocs - ks->lastallocs) * 1000 / msecs);
+		}
+		else {
+			kprintf("        -\n");
+		}
+	}
+
+	for (i = 0; i < KMSITES; i++) {
+		kmsites[i].lastallocs = kmsites[i].allocs;
+	}
+	kmsites_lastsecs = secs;
+	kmsites_lastnsecs = nsecs;
+}
+#endif /* OPT_KHEAPSTATS */
+
+#if OPT_KHEAPDEBUG
+/*
+ * Debugging checks, for kernels built with the kheapdebug option.
+ *
+ * kfree fills freed blocks with 0xdeadbeef, so a dangling pointer
+ * reads garbage that is easy to spot. A block being freed that
+ * already looks like that is looked for on its page's free list, so
+ * freeing it twice panics instead of corrupting the list.
+ *
+ * Every small block also gets a redzone: kmalloc asks for KMRED_SIZE
+ * more than the caller did, stores the size the caller asked for in the
+ * word before the tag and fills the bytes in between with KMRED_BYTE.
+ * kfree checks they are still there.
+ */
+
+#define KMRED_BYTE	0xa5
+
+/* where the size the caller asked for is kept */
+#define KMRED_SIZEP(block, blocksize) \
+	((u_int32_t *)((vaddr_t)(block) + (blocksize) - KMTAG_SIZE - \
+		       sizeof(u_int32_t)))
+
+static
+void
+kmred_set(void *block, size_t blocksize, size_t sz)
+{
+	u_int32_t *sizep = KMRED_SIZEP(block, blocksize);
+	u_int8_t *p;
+
+	*sizep = sz;
+	for (p = (u_int8_t *)block + sz; p < (u_int8_t *)sizep; p++) {
+		*p = KMRED_BYTE;
+	}
+}
+
+static
+void
+kmred_check(void *block, size_t blocksize)
+{
+	u_int32_t *sizep = KMRED_SIZEP(block, blocksize);
+	u_int8_t *p;
+
+	if (*sizep > blocksize - KMTAG_SIZE - KMRED_SIZE) {
+		panic("kfree: end of block %p overwritten\n", block);
+	}
+	for (p = (u_int8_t *)block + *sizep; p < (u_int8_t *)sizep; p++) {
+		if (*p != KMRED_BYTE) {
+			panic("kfree: %u-byte block %p overwritten at "
+			      "offset %u\n", *sizep, block,
+			      (unsigned)(p - (u_int8_t *)block));
+		}
+	}
+}
+
+static
+void
+check_double_free(struct pageref *pr, vaddr_t ptraddr)
+{
+	struct freelist *fl;
+
+	assert(curspl>0);
+
+	/* the first word of a free block is its link; the rest is filled */
+	if (((u_int32_t *)ptraddr)[1] != 0xdeadbeef ||
+	    pr->freelist_offset == INVALID_OFFSET) {
+		return;
+	}
+
+	fl = (struct freelist *)(PR_PAGEADDR(pr) + pr->freelist_offset);
+	for (; fl != NULL; fl = fl->next) {
+		if ((vaddr_t)fl == ptraddr) {
+			panic("kfree: %p freed twice\n", (void *)ptraddr);
+		}
+	}
+}
+#endif /* OPT_KHEAPDEBUG */
+
+/*
+ * Finding the pageref of a pointer. Heap pages that come from the
+ * coremap keep a pointer to it in cmap[].pageref, which is NULL for
+ * pages handed out whole, so kfree can tell the two kinds apart
+ * without searching. The few pages kmalloc got before the coremap
+ * existed aren't in it; only for those do we walk the list.
+ */
+static
+int
+page_in_coremap(vaddr_t page)
+{
+	return vm_bootstrap_done &&
+		KVADDR_TO_PADDR(page) >= cmap_start_physaddr;
+}
+
+static
+struct pageref *
+findpageref(vaddr_t page)
+{
+	struct pageref *pr;
+
+	if (page_in_coremap(page)) {
+		return cmap[PADDR_TO_CMAP_INDEX(KVADDR_TO_PADDR(page))].pageref;
+	}
+	for (pr = allbase; pr != NULL; pr = pr->next_all) {
+		if (PR_PAGEADDR(pr) == page) {
+			return pr;
+		}
+	}
+	return NULL;
+}
+
+static
+void
+setpageref(vaddr_t page, struct pageref *pr)
+{
+	if (page_in_coremap(page)) {
+		cmap[PADDR_TO_CMAP_INDEX(KVADDR_TO_PADDR(page))].pageref = pr;
+	}
+}
+
 ////////////////////////////////////////
 
 /* SLOWER implies SLOW */
@@ -215,14 +587,21 @@ checksubpages(void)
 	for (i=0; i<NSIZES; i++) {
 		for (pr = sizebases[i]; pr != NULL; pr = pr->next_samesize) {
 			checksubpage(pr);
-			assert(sc < NPAGEREFS);
+			assert(pr->nfree > 0);
+			assert(sc < npagerefpages*NPAGEREFS);
+			sc++;
+		}
+		for (pr = fullbases[i]; pr != NULL; pr = pr->next_samesize) {
+			checksubpage(pr);
+			assert(pr->nfree == 0);
+			assert(sc < npagerefpages*NPAGEREFS);
 			sc++;
 		}
 	}
 
 	for (pr = allbase; pr != NULL; pr = pr->next_all) {
 		checksubpage(pr);
-		assert(ac < NPAGEREFS);
+		assert(ac < npagerefpages*NPAGEREFS);
 		ac++;
 	}
 
@@ -285,20 +664,89 @@ dumpsubpage(struct pageref *pr)
 	kprintf("\n");
 }
 
+static void kmem_cache_printstats(void);
+
 void
-kheap_printstats(void)
+kheap_printstats(int pagemaps)
 {
 	struct pageref *pr;
+	unsigned i;
 
 	/* print the whole thing with interrupts off */
 	int spl = splhigh();
 
-	kprintf("Subpage allocator status:\n");
+	kprintf("Subpage allocator status: %u page(s) of pagerefs, "
+		"%u page(s) of big blocks\n", npagerefpages, bigpages);
 
-	for (pr = allbase; pr != NULL; pr = pr->next_all) {
-		dumpsubpage(pr);
+	kprintf("  size  pages       hits     misses\n");
+	for (i=0; i<NSIZES; i++) {
+		kprintf("  %4lu  %5u %10lu %10lu\n", (unsigned long)sizes[i],
+			sizepages[i], sizehits[i], sizemisses[i]);
+	}
+
+	if (pagemaps) {
+		for (pr = allbase; pr != NULL; pr = pr->next_all) {
+			dumpsubpage(pr);
+		}
+	}
+
+	kmem_cache_printstats();
+
+#if OPT_KHEAPSTATS
+	kmsites_printstats();
+#endif
+
+	splx(spl);
+}
+
+#if NSIZES != KHS_NSIZES
+#error "struct kheapstat has the wrong number of size classes"
+#endif
+
+/*
+ * Fills in KS for kheapstat().
+ */
+void
+kheap_getstat(struct kheapstat *ks)
+{
+	time_t secs;
+	u_int32_t nsecs;
+	unsigned i;
+	int spl;
+#if OPT_KHEAPSTATS
+	unsigned order[KHS_NSITES];
+	struct kmsite *site;
+#endif
+
+	bzero(ks, sizeof(struct kheapstat));
+
+	gettime(&secs, &nsecs);
+	ks->kh_secs = secs;
+	ks->kh_nsecs = nsecs;
+
+	spl = splhigh();
+
+	ks->kh_pagerefpages = npagerefpages;
+	ks->kh_bigpages = bigpages;
+	for (i=0; i<NSIZES; i++) {
+		ks->kh_size[i] = sizes[i];
+		ks->kh_sizepages[i] = sizepages[i];
+		ks->kh_hits[i] = sizehits[i];
+		ks->kh_misses[i] = sizemisses[i];
 	}
 
+#if OPT_KHEAPSTATS
+	ks->kh_nsites = kmsites_sort(order, KHS_NSITES);
+	for (i=0; i<ks->kh_nsites; i++) {
+		site = &kmsites[order[i]];
+		ks->kh_sites[i].ks_caller = site->caller;
+		ks->kh_sites[i].ks_bytes = site->bytes;
+		ks->kh_sites[i].ks_peak = site->peak;
+		ks->kh_sites[i].ks_allocs = site->allocs;
+		ks->kh_sites[i].ks_frees = site->frees;
+	}
+#endif
+
 	splx(spl);
 }
 
@@ -306,27 +754,68 @@ kheap_printstats(void)
 
 static
 void
-remove_lists(struct pageref *pr, int blktype)
+add_lists(struct pageref *pr, int blktype)
 {
-	struct pageref **guy;
+	assert(blktype>=0 && blktype<NSIZES);
+
+	pr->next_samesize = sizebases[blktype];
+	pr->prev_samesize = &sizebases[blktype];
+	if (pr->next_samesize != NULL) {
+		pr->next_samesize->prev_samesize = &pr->next_samesize;
+	}
+	sizebases[blktype] = pr;
+
+	pr->next_all = allbase;
+	pr->prev_all = &allbase;
+	if (pr->next_all != NULL) {
+		pr->next_all->prev_all = &pr->next_all;
+	}
+	allbase = pr;
+}
 
+static
+void
+unlink_samesize(struct pageref *pr)
+{
+	assert(*pr->prev_samesize == pr);
+
+	*pr->prev_samesize = pr->next_samesize;
+	if (pr->next_samesize != NULL) {
+		pr->next_samesize->prev_samesize = pr->prev_samesize;
+	}
+}
+
+static
+void
+remove_lists(struct pageref *pr, int blktype)
+{
 	assert(blktype>=0 && blktype<NSIZES);
+	assert(*pr->prev_all == pr);
 
-	for (guy = &sizebases[blktype]; *guy; guy = &(*guy)->next_samesize) {
-		checksubpage(*guy);
-		if (*guy == pr) {
-			*guy = pr->next_samesize;
-			break;
-		}
+	unlink_samesize(pr);
+
+	*pr->prev_all = pr->next_all;
+	if (pr->next_all != NULL) {
+		pr->next_all->prev_all = pr->prev_all;
 	}
+}
 
-	for (guy = &allbase; *guy; guy = &(*guy)->next_all) {
-		checksubpage(*guy);
-		if (*guy == pr) {
-			*guy = pr->next_all;
-			break;
-		}
+/*
+ * Moves pr to the front of HEAD, which is its sizebases[] or
+ * fullbases[] entry.
+ */
+static
+void
+move_samesize(struct pageref *pr, struct pageref **head)
+{
+	unlink_samesize(pr);
+
+	pr->next_samesize = *head;
+	pr->prev_samesize = head;
+	if (pr->next_samesize != NULL) {
+		pr->next_samesize->prev_samesize = &pr->next_samesize;
 	}
+	*head = pr;
 }
 
 static
@@ -369,41 +858,43 @@ subpage_kmalloc(size_t sz)
 
 	checksubpages();
 
-	for (pr = sizebases[blktype]; pr != NULL; pr = pr->next_samesize) {
+	pr = sizebases[blktype];
+	if (pr != NULL) {
 
 		/* check for corruption */
 		assert(PR_BLOCKTYPE(pr) == blktype);
 		checksubpage(pr);
+		assert(pr->nfree > 0);
 
-		if (pr->nfree > 0) {
+		sizehits[blktype]++;
 
-		doalloc: /* comes here after getting a whole fresh page */
+	doalloc: /* comes here after getting a whole fresh page */
 
-			assert(pr->freelist_offset < PAGE_SIZE);
-			prpage = PR_PAGEADDR(pr);
-			fla = prpage + pr->freelist_offset;
-			fl = (struct freelist *)fla;
+		assert(pr->freelist_offset < PAGE_SIZE);
+		prpage = PR_PAGEADDR(pr);
+		fla = prpage + pr->freelist_offset;
+		fl = (struct freelist *)fla;
 
-			retptr = fl;
-			fl = fl->next;
-			pr->nfree--;
+		retptr = fl;
+		fl = fl->next;
+		pr->nfree--;
 
-			if (fl != NULL) {
-				assert(pr->nfree > 0);
-				fla = (vaddr_t)fl;
-				assert(fla - prpage < PAGE_SIZE);
-				pr->freelist_offset = fla - prpage;
-			}
-			else {
-				assert(pr->nfree == 0);
-				pr->freelist_offset = INVALID_OFFSET;
-			}
+		if (fl != NULL) {
+			assert(pr->nfree > 0);
+			fla = (vaddr_t)fl;
+			assert(fla - prpage < PAGE_SIZE);
+			pr->freelist_offset = fla - prpage;
+		}
+		else {
+			assert(pr->nfree == 0);
+			pr->freelist_offset = INVALID_OFFSET;
+			move_samesize(pr, &fullbases[blktype]);
+		}
 
-			checksubpages();
+		checksubpages();
 
-			splx(spl);
-			return retptr;
-		}
+		splx(spl);
+		return retptr;
 	}
 
 	/*
@@ -449,11 +940,10 @@ subpage_kmalloc(size_t sz)
 	pr->freelist_offset = fla - prpage;
 	assert(pr->freelist_offset == (pr->nfree-1)*sizes[blktype]);
 
-	pr->next_samesize = sizebases[blktype];
-	sizebases[blktype] = pr;
-
-	pr->next_all = allbase;
-	allbase = pr;
+	add_lists(pr, blktype);
+	setpageref(prpage, pr);
+	sizepages[blktype]++;
+	sizemisses[blktype]++;
 
 	/* This is kind of cheesy, but avoids duplicating the alloc code. */
 	goto doalloc;
@@ -478,25 +968,21 @@ subpage_kfree(void *ptr)
 
 	checksubpages();
 
-	for (pr = allbase; pr; pr = pr->next_all) {
-		prpage = PR_PAGEADDR(pr);
-		blktype = PR_BLOCKTYPE(pr);
-
-		/* check for corruption */
-		assert(blktype>=0 && blktype<NSIZES);
-		checksubpage(pr);
-
-		if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
-			break;
-		}
-	}
-
+	pr = findpageref(ptraddr & PAGE_FRAME);
 	if (pr==NULL) {
 		/* Not on any of our pages - not a subpage allocation */
 		splx(spl);
 		return -1;
 	}
 
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
+
+	/* check for corruption */
+	assert(prpage == (ptraddr & PAGE_FRAME));
+	assert(blktype>=0 && blktype<NSIZES);
+	checksubpage(pr);
+
 	offset = ptraddr - prpage;
 
 	/* Check for proper positioning and alignment */
@@ -504,16 +990,22 @@ subpage_kfree(void *ptr)
 		panic("kfree: subpage free of invalid addr %p\n", ptr);
 	}
 
+#if OPT_KHEAPDEBUG
+	check_double_free(pr, ptraddr);
+	kmred_check(ptr, sizes[blktype]);
+#endif
+
+#if OPT_KHEAPSTATS
+	kmtag_clear(ptr, sizes[blktype]);
+#endif
+
+#if OPT_KHEAPDEBUG
 	/*
 	 * Clear the block to 0xdeadbeef to make it easier to detect
 	 * uses of dangling pointers.
 	 */
 	fill_deadbeef(ptr, sizes[blktype]);
-
-	/*
-	 * We probably ought to check for free twice by seeing if the block
-	 * is already on the free list. But that's expensive, so we don't.
-	 */
+#endif
 
 	fla = prpage + offset;
 	fl = (struct freelist *)fla;
@@ -525,10 +1017,17 @@ subpage_kfree(void *ptr)
 	pr->freelist_offset = offset;
 	pr->nfree++;
 
+	if (pr->nfree == 1) {
+		/* It was full; kmalloc can use it again. */
+		move_samesize(pr, &sizebases[blktype]);
+	}
+
 	assert(pr->nfree <= PAGE_SIZE / sizes[blktype]);
 	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
 		/* Whole page is free. */
 		remove_lists(pr, blktype);
+		setpageref(prpage, NULL);
+		sizepages[blktype]--;
 		free_kpages(prpage);
 		freepageref(pr);
 	}
@@ -542,10 +1041,51 @@ subpage_kfree(void *ptr)
 //
 ////////////////////////////////////////////////////////////
 
+/*
+ * Pages of a big kmalloc. Only pages the coremap knows about can be
+ * freed, and it keeps track of how many there are.
+ */
+static
+struct cmap_entry *
+bigblock_entry(vaddr_t addr)
+{
+	if (!page_in_coremap(addr)) {
+		return NULL;
+	}
+	return &cmap[PADDR_TO_CMAP_INDEX(KVADDR_TO_PADDR(addr))];
+}
+
+static
+unsigned
+bigblock_pages(vaddr_t addr)
+{
+	struct cmap_entry *ce = bigblock_entry(addr);
+
+	if (ce == NULL) {
+		return 0;
+	}
+#if OPT_KHEAPDEBUG
+	if (!ce->first_page) {
+		panic("kfree: %p freed twice or never allocated\n",
+		      (void *)addr);
+	}
+#endif
+	return ce->num_pages;
+}
+
 void *
 kmalloc(size_t sz)
 {
-	if (sz>=LARGEST_SUBPAGE_SIZE) {
+	void *ptr;
+	size_t reqsz = sz;
+	size_t blocksize;
+	int spl;
+#if OPT_KHEAPSTATS
+	vaddr_t caller = (vaddr_t)__builtin_return_address(0);
+	struct cmap_entry *ce;
+#endif
+
+	if (sz + KMTAG_SIZE + KMRED_SIZE >= LARGEST_SUBPAGE_SIZE) {
 		unsigned long npages;
 		vaddr_t address;
 
@@ -556,15 +1096,50 @@ kmalloc(size_t sz)
 			return NULL;
 		}
 
+		spl = splhigh();
+		bigpages += npages;
+#if OPT_KHEAPSTATS
+		ce = bigblock_entry(address);
+		if (ce != NULL) {
+			ce->kmsite = 1 + kmsite_charge(caller,
+						       npages * PAGE_SIZE);
+		}
+#endif
+		splx(spl);
+
 		return (void *)address;
 	}
 
-	return subpage_kmalloc(sz);
+	/* room for the tag and the redzone */
+	sz += KMTAG_SIZE + KMRED_SIZE;
+
+	ptr = subpage_kmalloc(sz);
+	if (ptr == NULL) {
+		return NULL;
+	}
+	blocksize = sizes[blocktype(sz)];
+
+#if OPT_KHEAPDEBUG
+	kmred_set(ptr, blocksize, reqsz);
+#endif
+#if OPT_KHEAPSTATS
+	kmtag_set(ptr, blocksize, caller);
+#endif
+	(void)reqsz;
+	(void)blocksize;
+
+	return ptr;
 }
 
 void
 kfree(void *ptr)
 {
+	unsigned npages;
+	int spl;
+#if OPT_KHEAPSTATS
+	struct cmap_entry *ce;
+#endif
+
 	/*
 	 * Try subpage first; if that fails, assume it's a big allocation.
 	 */
@@ -574,7 +1149,369 @@ kfree(void *ptr)
 		//kprintf("va = %d\n", (vaddr_t)ptr);
 		//if(((vaddr_t)ptr) < 0) return;
 		assert((vaddr_t)ptr%PAGE_SIZE==0);
+
+		npages = bigblock_pages((vaddr_t)ptr);
+		spl = splhigh();
+#if OPT_KHEAPSTATS
+		ce = bigblock_entry((vaddr_t)ptr);
+		if (ce != NULL && ce->kmsite > 0) {
+			kmsite_uncharge(ce->kmsite - 1, npages * PAGE_SIZE);
+			ce->kmsite = 0;
+		}
+#endif
+		assert(bigpages >= npages);
+		bigpages -= npages;
+		splx(spl);
+
+		free_kpages((vaddr_t)ptr);
+	}
+}
+
+////////////////////////////////////////////////////////////
+//
+// Object caches.
+//
+//    A cache hands out objects of one exact size, for the structures
+//    the kernel makes and throws away all the time (threads, address
+//    spaces, vnodes...). Rounding those up to the next size in sizes[]
+//    wastes up to half of each block; a cache packs them as tightly as
+//    their alignment allows.
+//
+//    Small objects live in slabs: pages with a struct kmem_slab at the
+//    start and the objects after it. The slab of an object is found by
+//    masking its address, so freeing is constant time. Slabs with free
+//    objects are on the cache's partial list, the others on its full
+//    list. One empty slab is kept so that a cache whose objects come
+//    and go doesn't allocate and free a page every time.
+//
+//    Objects too big for two of them to fit in a slab are allocated
+//    as whole pages, and a few freed ones are kept for reuse.
+//
+//    If the cache has a constructor, it is run on each object once,
+//    when its memory is first handed to the cache. Objects must be in
+//    their constructed state when they are freed, and the free list
+//    link is kept past the end of the object so it doesn't disturb
+//    that state.
+//
+//    Pages taken before the coremap existed can't be given back, so
+//    their slabs are kept even when empty.
+//
+
+#define KMEM_ALIGN		8	/* alignment of objects in a slab */
+#define KMEM_EMPTY_KEEP		1	/* empty slabs a cache holds on to */
+#define KMEM_LARGE_KEEP		8	/* freed large objects kept for reuse */
+
+struct kmem_slab {
+	struct kmem_slab *next;
+	struct kmem_slab **prev;	/* the pointer that points at us */
+	struct kmem_cache *cache;
+	void *freelist;
+	unsigned nfree;
+};
+
+#define SLAB_HEADER_SIZE \
+	(DIVROUNDUP(sizeof(struct kmem_slab), KMEM_ALIGN) * KMEM_ALIGN)
+
+struct kmem_cache {
+	const char *name;
+	size_t objsize;			/* what the caller asked for */
+	size_t stride;			/* distance between objects in a slab */
+	size_t linkoff;			/* where the free list link is */
+	void (*ctor)(void *obj);
+	unsigned perslab;		/* objects per slab; 0 for large objects */
+	unsigned npages;		/* pages per large object */
+
+	struct kmem_slab *partial;	/* slabs with free objects */
+	struct kmem_slab *full;		/* slabs without */
+	unsigned nempty;		/* empty slabs on the partial list */
+	void *large[KMEM_LARGE_KEEP];	/* freed large objects */
+	unsigned nlarge;
+
+	/* statistics */
+	unsigned long allocs;
+	unsigned long frees;
+	unsigned long fails;
+	unsigned inuse;			/* objects handed out */
+	unsigned peak;			/* most ever handed out at once */
+	unsigned pages;			/* pages the cache holds */
+
+	struct kmem_cache *next_cache;
+};
+
+static struct kmem_cache *kmem_caches;
+
+/* where obj keeps the address of the next free object */
+#define OBJLINK(kc, obj) ((void **)((vaddr_t)(obj) + (kc)->linkoff))
+
+static
+void
+slab_link(struct kmem_slab **head, struct kmem_slab *slab)
+{
+	slab->next = *head;
+	slab->prev = head;
+	if (slab->next != NULL) {
+		slab->next->prev = &slab->next;
+	}
+	*head = slab;
+}
+
+static
+void
+slab_unlink(struct kmem_slab *slab)
+{
+	assert(*slab->prev == slab);
+
+	*slab->prev = slab->next;
+	if (slab->next != NULL) {
+		slab->next->prev = slab->prev;
+	}
+}
+
+struct kmem_cache *
+kmem_cache_create(const char *name, size_t size, void (*ctor)(void *obj))
+{
+	struct kmem_cache *kc;
+	int spl;
+
+	assert(size > 0);
+
+	kc = kmalloc(sizeof(struct kmem_cache));
+	if (kc == NULL) {
+		return NULL;
+	}
+
+	kc->name = name;
+	kc->objsize = size;
+	kc->ctor = ctor;
+	if (ctor != NULL) {
+		kc->linkoff = DIVROUNDUP(size, sizeof(void *)) * sizeof(void *);
+		kc->stride = kc->linkoff + sizeof(void *);
+	}
+	else {
+		kc->linkoff = 0;
+		kc->stride = size;
+	}
+	kc->stride = DIVROUNDUP(kc->stride, KMEM_ALIGN) * KMEM_ALIGN;
+
+	kc->perslab = (PAGE_SIZE - SLAB_HEADER_SIZE) / kc->stride;
+	kc->npages = 0;
+	if (kc->perslab < 2) {
+		kc->perslab = 0;
+		kc->npages = DIVROUNDUP(size, PAGE_SIZE);
+	}
+
+	kc->partial = kc->full = NULL;
+	kc->nempty = 0;
+	kc->nlarge = 0;
+	kc->allocs = kc->frees = kc->fails = 0;
+	kc->inuse = kc->peak = kc->pages = 0;
+
+	spl = splhigh();
+	kc->next_cache = kmem_caches;
+	kmem_caches = kc;
+	splx(spl);
+
+	return kc;
+}
+
+/*
+ * Gets a fresh slab onto the partial list. Call at splhigh.
+ */
+static
+struct kmem_slab *
+slab_create(struct kmem_cache *kc)
+{
+	struct kmem_slab *slab;
+	vaddr_t page, obj;
+	unsigned i;
+
+	page = alloc_kpages(1);
+	if (page == 0) {
+		return NULL;
+	}
+
+	slab = (struct kmem_slab *)page;
+	slab->cache = kc;
+	slab->freelist = NULL;
+	slab->nfree = kc->perslab;
+
+	/* link them backwards so they are handed out in address order */
+	for (i = kc->perslab; i > 0; i--) {
+		obj = page + SLAB_HEADER_SIZE + (i-1) * kc->stride;
+		if (kc->ctor != NULL) {
+			kc->ctor((void *)obj);
+		}
+		*OBJLINK(kc, obj) = slab->freelist;
+		slab->freelist = (void *)obj;
+	}
+
+	slab_link(&kc->partial, slab);
+	kc->nempty++;
+	kc->pages++;
+	return slab;
+}
+
+static
+void *
+large_alloc(struct kmem_cache *kc)
+{
+	vaddr_t addr;
+
+	if (kc->nlarge > 0) {
+		return kc->large[--kc->nlarge];
+	}
+
+	addr = alloc_kpages(kc->npages);
+	if (addr == 0) {
+		return NULL;
+	}
+	if (kc->ctor != NULL) {
+		kc->ctor((void *)addr);
+	}
+	kc->pages += kc->npages;
+	return (void *)addr;
+}
+
+static
+void
+large_free(struct kmem_cache *kc, void *ptr)
+{
+	if (kc->nlarge < KMEM_LARGE_KEEP) {
+		kc->large[kc->nlarge++] = ptr;
+	}
+	else if (page_in_coremap((vaddr_t)ptr)) {
 		free_kpages((vaddr_t)ptr);
+		kc->pages -= kc->npages;
+	}
+	/* else it was stolen before the coremap existed and stays lost */
+}
+
+void *
+kmem_cache_alloc(struct kmem_cache *kc)
+{
+	struct kmem_slab *slab;
+	void *ptr;
+	int spl;
+
+	spl = splhigh();
+
+	if (kc->perslab == 0) {
+		ptr = large_alloc(kc);
+	}
+	else {
+		slab = kc->partial;
+		if (slab == NULL) {
+			slab = slab_create(kc);
+		}
+		if (slab == NULL) {
+			ptr = NULL;
+		}
+		else {
+			assert(slab->cache == kc && slab->nfree > 0);
+
+			if (slab->nfree == kc->perslab) {
+				kc->nempty--;
+			}
+			ptr = slab->freelist;
+			slab->freelist = *OBJLINK(kc, ptr);
+			slab->nfree--;
+
+			if (slab->nfree == 0) {
+				slab_unlink(slab);
+				slab_link(&kc->full, slab);
+			}
+		}
+	}
+
+	if (ptr == NULL) {
+		kc->fails++;
+	}
+	else {
+		kc->allocs++;
+		kc->inuse++;
+		if (kc->inuse > kc->peak) {
+			kc->peak = kc->inuse;
+		}
+	}
+
+	splx(spl);
+	return ptr;
+}
+
+void
+kmem_cache_free(struct kmem_cache *kc, void *ptr)
+{
+	struct kmem_slab *slab;
+	vaddr_t page, offset;
+	int spl;
+
+	if (ptr == NULL) {
+		return;
 	}
+
+	spl = splhigh();
+
+	assert(kc->inuse > 0);
+	kc->frees++;
+	kc->inuse--;
+
+	if (kc->perslab == 0) {
+		assert((vaddr_t)ptr % PAGE_SIZE == 0);
+		large_free(kc, ptr);
+		splx(spl);
+		return;
+	}
+
+	page = (vaddr_t)ptr & PAGE_FRAME;
+	slab = (struct kmem_slab *)page;
+	offset = (vaddr_t)ptr - page;
+
+	if (slab->cache != kc || offset < SLAB_HEADER_SIZE ||
+	    (offset - SLAB_HEADER_SIZE) % kc->stride != 0) {
+		panic("kmem_cache_free: %p is not from cache %s\n",
+		      ptr, kc->name);
+	}
+	assert(slab->nfree < kc->perslab);
+
+	*OBJLINK(kc, ptr) = slab->freelist;
+	slab->freelist = ptr;
+	slab->nfree++;
+
+	if (slab->nfree == 1) {
+		/* it was full */
+		slab_unlink(slab);
+		slab_link(&kc->partial, slab);
+	}
+
+	if (slab->nfree == kc->perslab) {
+		kc->nempty++;
+		if (kc->nempty > KMEM_EMPTY_KEEP && page_in_coremap(page)) {
+			slab_unlink(slab);
+			kc->nempty--;
+			kc->pages--;
+			free_kpages(page);
+		}
+	}
+
+	splx(spl);
 }
 
+static
+void
+kmem_cache_printstats(void)
+{
+	struct kmem_cache *kc;
+
+	assert(curspl>0);
+
+	kprintf("Object caches:\n");
+	for (kc = kmem_caches; kc != NULL; kc = kc->next_cache) {
+		kprintf("  %-12s size %4lu (%4lu)  %3u/slab  "
+			"%5u in use, peak %5u  %4u page(s)  "
+			"%lu allocs  %lu frees  %lu failed\n",
+			kc->name, (unsigned long)kc->objsize,
+			(unsigned long)kc->stride, kc->perslab,
+			kc->inuse, kc->peak, kc->pages,
+			kc->allocs, kc->frees, kc->fails);
+	}
+}
@@ -16,6 +16,7 @@
 #include <vm.h>
 #include <syscall.h>
 #include <version.h>
+#include "opt-dumbvm.h"
 #include "hello.h"                  #Aya and Harshita
 
 /*
@@ -78,6 +79,10 @@ boot(void)
 	vfs_bootstrap();
 	dev_bootstrap();
 	vm_bootstrap();
+#if !OPT_DUMBVM
+	pageout_bootstrap();
+#endif
+	fork_bootstrap();
 	kprintf_bootstrap();
 
 	/* Default bootfs - but ignore failure, in case emu0 doesn't exist */
@@ -6,6 +6,7 @@
 #include <kern/errno.h>
 #include <kern/unistd.h>
 #include <kern/limits.h>
+#include <kern/vmstat.h>
 #include <lib.h>
 #include <clock.h>
 #include <thread.h>
@@ -14,6 +15,8 @@
 #include <vfs.h>
 #include <sfs.h>
 #include <test.h>
+#include <vm.h>
+#include <machine/spl.h>
 #include "opt-synchprobs.h"
 #include "opt-sfs.h"
 #include "opt-net.h"
@@ -349,15 +352,158 @@ cmd_bootfs(int nargs, char **args)
 	return vfs_setbootfs(device);
 }
 
+/*
+ * Command for printing the kernel heap's counters; "kh pages" also
+ * prints a map of every page of small blocks.
+ */
 static
 int
 cmd_kheapstats(int nargs, char **args)
 {
+	if (nargs > 2 || (nargs == 2 && strcmp(args[1], "pages"))) {
+		kprintf("Usage: kh [pages]\n");
+		return EINVAL;
+	}
+
+	kheap_printstats(nargs == 2);
+	
+	return 0;
+}
+
+/*
+ * Command for showing or changing the page replacement policy.
+ */
+static
+int
+cmd_vmpolicy(int nargs, char **args)
+{
+	int result;
+
+	if (nargs > 2) {
+		kprintf("Usage: vmp [fifo|clock|wsclock]\n");
+		return EINVAL;
+	}
+
+	if (nargs == 2) {
+		result = vm_set_policy(args[1]);
+		if (result) {
+			kprintf("vmp: unknown policy %s\n", args[1]);
+			return result;
+		}
+	}
+
+	kprintf("Page replacement policy: %s (%lu evictions, %lu written to swap, "
+		"%lu swap I/Os)\n",
+		vm_get_policy(), vm_evictions, vm_swap_writes, vm_swap_ios);
+	return 0;
+}
+
+/*
+ * Command for showing the TLB fill counters and setting how many
+ * pages are prefetched on a miss. Setting it resets the counters.
+ */
+static
+int
+cmd_tlbstats(int nargs, char **args)
+{
+	int n;
+
+	if (nargs > 2) {
+		kprintf("Usage: tlb [prefetch pages, 0-%d]\n", TLB_PREFETCH_MAX);
+		return EINVAL;
+	}
+
+	if (nargs == 2) {
+		n = atoi(args[1]);
+		if (n < 0 || n > TLB_PREFETCH_MAX) {
+			kprintf("Usage: tlb [prefetch pages, 0-%d]\n", TLB_PREFETCH_MAX);
+			return EINVAL;
+		}
+		tlb_prefetch = n;
+		tlb_misses = tlb_modfaults = tlb_fastfills = tlb_prefetched = 0;
+		tlb_rangefills = 0;
+	}
+
+	kprintf("TLB: %lu misses (%lu fast), %lu modify faults, "
+		"%lu prefetched (%d per miss), %lu superpage refills\n",
+		tlb_misses, tlb_fastfills, tlb_modfaults, tlb_prefetched,
+		tlb_prefetch, tlb_rangefills);
+	return 0;
+}
+
+/*
+ * Command for printing the memory counters of the VM system and the
+ * resident set and fault counts of every running process.
+ */
+static
+int
+cmd_vmstats(int nargs, char **args)
+{
+	struct vmstat vs;
+	struct thread *t;
+	int i, spl;
+
 	(void)nargs;
 	(void)args;
 
-	kheap_printstats();
-	
+	vm_getstat(NULL, &vs);
+	kprintf("Memory: %u pages, %u free, %u user\n",
+		vs.vs_pages, vs.vs_free, vs.vs_user);
+	kprintf("Swap:   %u slots, %u free, %u pages in, %u pages out, "
+		"%u I/Os, %u evictions\n",
+		vs.vs_swap, vs.vs_swapfree, vs.vs_tswapin, vs.vs_tswapout,
+		vs.vs_swapios, vs.vs_evictions);
+	kprintf("Faults: %u minor, %u major, %u TLB misses\n",
+		vs.vs_tminflt, vs.vs_tmajflt, vs.vs_tlbmisses);
+	kprintf("Commit: %u of %u pages reserved, %u processes killed by OOM\n",
+		vs.vs_committed, vs.vs_commitlimit, vs.vs_oomkills);
+
+	kprintf("  pid      rss  swapped reserved   minflt   majflt   swapin  swapout  name\n");
+	spl = splhigh();
+	for (i = PID_MIN; i < MAX_PROCESSES; i++) {
+		t = process_table[i].p_thread;
+		if (t == NULL || t->t_vmspace == NULL) {
+			continue;
+		}
+		vm_getstat(t->t_vmspace, &vs);
+		kprintf("%5d %8u %8u %8u %8u %8u %8u %8u  %s\n", i,
+			vs.vs_rss, vs.vs_swapped, vs.vs_reserved,
+			vs.vs_minflt, vs.vs_majflt,
+			vs.vs_swapin, vs.vs_swapout, t->t_name);
+	}
+	splx(spl);
+	return 0;
+}
+
+/*
+ * Command for turning superpages on or off. Only programs started
+ * afterwards are affected.
+ */
+static
+int
+cmd_superpages(int nargs, char **args)
+{
+	if (nargs > 2) {
+		kprintf("Usage: sp [on|off]\n");
+		return EINVAL;
+	}
+
+	if (nargs == 2) {
+		if (!strcmp(args[1], "on")) {
+			vm_superpages = 1;
+		}
+		else if (!strcmp(args[1], "off")) {
+			vm_superpages = 0;
+		}
+		else {
+			kprintf("Usage: sp [on|off]\n");
+			return EINVAL;
+		}
+	}
+
+	kprintf("Superpages: %s (%d pages, %lu mapped, %lu TLB refills)\n",
+		vm_superpages ? "on" : "off", SUPERPAGE_PAGES,
+		vm_superfills, tlb_rangefills);
 	return 0;
 }
 
@@ -402,6 +548,9 @@ static const char *opsmenu[] = {
 	"[pwd]     Print current directory   ",
 	"[sync]    Sync filesystems          ",
 	"[panic]   Intentional panic         ",
+	"[vmp]     Page replacement policy   ",
+	"[tlb]     TLB stats / prefetch      ",
+	"[sp]      Superpages on/off         ",
 	"[q]       Quit and shut down        ",
 	NULL
 };
@@ -562,6 +711,7 @@ static const char *testmenu[] = {
 	"[qt]  Queue test                    ",
 	"[km1] Kernel malloc test            ",
 	"[km2] kmalloc stress test           ",
+	"[km3] kmalloc benchmark             ",
 	"[tt1] Thread test 1                 ",
 	"[tt2] Thread test 2                 ",
 	"[tt3] Thread test 3                 ",
@@ -605,6 +755,7 @@ static const char *mainmenu[] = {
 	"[1c] Stoplight                      ",
 #endif
 	"[kh] Kernel heap stats              ",
+	"[vms] VM and process memory stats   ",
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -647,6 +798,9 @@ static struct {
 	{ "pwd",	cmd_pwd },
 	{ "sync",	cmd_sync },
 	{ "panic",	cmd_panic },
+	{ "vmp",	cmd_vmpolicy },
+	{ "tlb",	cmd_tlbstats },
+	{ "sp",		cmd_superpages },
 	{ "q",		cmd_quit },
 	{ "exit",	cmd_quit },
 	{ "halt",	cmd_quit },
@@ -663,6 +817,7 @@ static struct {
 
 	/* stats */
 	{ "kh",         cmd_kheapstats },
+	{ "vms",        cmd_vmstats },
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -670,6 +825,7 @@ static struct {
 	{ "qt",		queuetest },
 	{ "km1",	malloctest },
 	{ "km2",	mallocstress },
+	{ "km3",	mallocbench },
 #if OPT_NET
 	{ "net",	nettest },
 #endif
@@ -2,10 +2,13 @@
  * Test code for kmalloc.
  */
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <synch.h>
 #include <thread.h>
 #include <test.h>
+#include <clock.h>
+#include <vm.h>
 
 /*
  * Test kmalloc; allocate ITEMSIZE bytes NTRIES times, freeing
@@ -108,3 +111,95 @@ mallocstress(int nargs, char **args)
 
 	return 0;
 }
+
+/*
+ * Time kmalloc with lots of full pages of the same size around.
+ *
+ * mallocbench holds NHELD blocks of BENCHSIZE bytes (enough to fill
+ * several dozen pages), then allocates and frees NBENCH more, keeping
+ * one of them live so the page they come from never empties out. Each
+ * of those allocations used to walk past every full page first; now
+ * it should cost the same however many are held.
+ *
+ * Usage: km3 [size [nheld]]
+ */
+
+#define NBENCH     10000
+#define NHELD      3000
+#define BENCHSIZE  64
+
+int
+mallocbench(int nargs, char **args)
+{
+	void **held;
+	void *ptr, *oldptr;
+	size_t size = BENCHSIZE;
+	unsigned nheld = NHELD;
+	unsigned i;
+	time_t secs1, secs2;
+	u_int32_t nsecs1, nsecs2;
+
+	if (nargs > 1) {
+		size = atoi(args[1]);
+	}
+	if (nargs > 2) {
+		nheld = atoi(args[2]);
+	}
+	if (size == 0 || size >= PAGE_SIZE/2 || nheld == 0) {
+		kprintf("Usage: km3 [size [nheld]] (size 1-%u)\n",
+			PAGE_SIZE/2 - 1);
+		return EINVAL;
+	}
+
+	held = kmalloc(nheld * sizeof(void *));
+	if (held == NULL) {
+		kprintf("kmalloc bench: out of memory\n");
+		return ENOMEM;
+	}
+
+	kprintf("Starting kmalloc benchmark: %u blocks of %u bytes held...\n",
+		nheld, (unsigned)size);
+
+	for (i=0; i<nheld; i++) {
+		held[i] = kmalloc(size);
+		if (held[i] == NULL) {
+			kprintf("kmalloc bench: out of memory after %u blocks\n",
+				i);
+			nheld = i;
+			goto done;
+		}
+	}
+
+	oldptr = NULL;
+	gettime(&secs1, &nsecs1);
+	for (i=0; i<NBENCH; i++) {
+		ptr = kmalloc(size);
+		if (ptr == NULL) {
+			break;
+		}
+		kfree(oldptr);
+		oldptr = ptr;
+	}
+	kfree(oldptr);
+	gettime(&secs2, &nsecs2);
+
+	if (nsecs2 < nsecs1) {
+		secs2--;
+		nsecs2 += 1000000000;
+	}
+	nsecs2 -= nsecs1;
+	secs2 -= secs1;
+
+	kprintf("%u kmalloc/kfree pairs: %lu.%09lu seconds, %lu ns each\n",
+		i, (unsigned long)secs2, (unsigned long)nsecs2,
+		i ? (unsigned long)(secs2 * (1000000000 / i) + nsecs2 / i) : 0UL);
+
+ done:
+	for (i=0; i<nheld; i++) {
+		kfree(held[i]);
+	}
+	kfree(held);
+	kprintf("kmalloc benchmark done\n");
+
+	return 0;
+}
@@ -11,6 +11,7 @@
 #include <thread.h>
 #include <machine/spl.h>
 #include <queue.h>
+#include <vm.h>
 
 /*
  *  Scheduler data
@@ -90,7 +91,11 @@ scheduler(void)
 	// meant to be called with interrupts off
 	assert(curspl>0);
 	
+	// nothing to run: zero at most one free page per pass, so an
+	// interrupt that makes a thread runnable never waits on more
+	// than one page being cleared
 	while (q_empty(runqueue)) {
+		vm_idle_zero();
 		cpu_idle();
 	}
 
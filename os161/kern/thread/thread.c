@@ -35,6 +35,9 @@ static struct array *zombies;
 /* Total number of outstanding threads. Does not count zombies[]. */
 static int numthreads;
 
+/* Where thread structures come from. */
+static struct kmem_cache *thread_cache;
+
 
 
 /*
@@ -48,6 +51,7 @@ void process_table_init(void){
 	for( i = 0; i < MAX_PROCESSES; i++){
 		process_table[i].p_thread = NULL;
 		process_table[i].exited = 0;
+		process_table[i].killed = 0;
 		process_table[i].ppid = -1;
 	}
 }
@@ -61,13 +65,13 @@ static
 struct thread *
 thread_create(const char *name)
 {
-	struct thread *thread = kmalloc(sizeof(struct thread));
+	struct thread *thread = kmem_cache_alloc(thread_cache);
 	if (thread==NULL) {
 		return NULL;
 	}
 	thread->t_name = kstrdup(name);
 	if (thread->t_name==NULL) {
-		kfree(thread);
+		kmem_cache_free(thread_cache, thread);
 		return NULL;
 	}
 	thread->t_sleepaddr = NULL;
@@ -89,6 +93,7 @@ thread_create(const char *name)
 			thread->t_pid = thread_pid;
 			process_table[thread_pid].p_thread = thread;
 			process_table[thread_pid].exited = 0;
+			process_table[thread_pid].killed = 0;
 
 			//init the semaphore = 0 so that if the parent calls wait_pid it has to P() on the semaphore
 			//until the thread releases the semaphore in thread_exit
@@ -139,7 +144,7 @@ thread_destroy(struct thread *thread)
 	}
 
 	kfree(thread->t_name);
-	kfree(thread);
+	kmem_cache_free(thread_cache, thread);
 }
 
 
@@ -232,6 +237,11 @@ thread_bootstrap(void)
 	if (zombies==NULL) {
 		panic("Cannot create zombies array\n");
 	}
+
+	thread_cache = kmem_cache_create("thread", sizeof(struct thread), NULL);
+	if (thread_cache==NULL) {
+		panic("Cannot create thread cache\n");
+	}
 	
 	/*
 	 * Create the thread structure for the first thread
@@ -300,7 +310,7 @@ thread_fork(const char *name,
 	newguy->t_stack = kmalloc(STACK_SIZE);
 	if (newguy->t_stack==NULL) {
 		kfree(newguy->t_name);
-		kfree(newguy);
+		kmem_cache_free(thread_cache, newguy);
 		return ENOMEM;
 	}
 
@@ -378,7 +388,7 @@ thread_fork(const char *name,
 	}
 	kfree(newguy->t_stack);
 	kfree(newguy->t_name);
-	kfree(newguy);
+	kmem_cache_free(thread_cache, newguy);
 
 	return result;
 }
@@ -510,7 +520,6 @@ thread_exit(void)
 		 */
 		struct addrspace *as = curthread->t_vmspace;
 		curthread->t_vmspace = NULL;
-		free_all_pages(as);
 		as_destroy(as);
 	}
 
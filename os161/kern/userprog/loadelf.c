@@ -1,11 +1,10 @@
 /*
  * Code to load an ELF-format executable into the current address space.
  *
- * Right now it just copies into userspace and hopes the addresses are
- * mappable to real memory. This works with dumbvm; however, when you
- * write a real VM system, you will need to either (1) add code that 
- * makes the address range used for load valid, or (2) if you implement
- * memory-mapped files, map each segment instead of copying it into RAM.
+ * With dumbvm the segments are copied into userspace right away. With
+ * the real VM system each segment is only recorded in its region
+ * (as_define_file) and vm_fault reads pages from the executable the
+ * first time they are touched.
  */
 
 #include <types.h>
@@ -18,6 +17,7 @@
 #include <curthread.h>
 #include <vnode.h>
 
+#if OPT_DUMBVM
 /*
  * Load a segment at virtual address VADDR. The segment in memory
  * extends from VADDR up to (but not including) VADDR+MEMSIZE. The
@@ -80,6 +80,7 @@ load_segment(struct vnode *v, off_t offset, vaddr_t vaddr,
 	
 	return result;
 }
+#endif /* OPT_DUMBVM */
 
 /*
  * Load an ELF executable user program into the current address space.
@@ -190,7 +191,7 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 	}
 
 	/*
-	 * Now actually load each segment.
+	 * Now actually load (or, without dumbvm, map) each segment.
 	 */
 	 
 	for (i=0; i<eh.e_phnum; i++) {
@@ -219,9 +220,14 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 			return ENOEXEC;
 		}
 
+#if OPT_DUMBVM
 		result = load_segment(v, ph.p_offset, ph.p_vaddr, 
 				      ph.p_memsz, ph.p_filesz,
 				      ph.p_flags & PF_X);
+#else
+		result = as_define_file(curthread->t_vmspace, v, ph.p_offset,
+					ph.p_vaddr, ph.p_memsz, ph.p_filesz);
+#endif
 		if (result) {
 			return result;
 		}
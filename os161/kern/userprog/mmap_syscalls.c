@@ -0,0 +1,183 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/unistd.h>
+#include <kern/limits.h>
+#include <kern/stat.h>
+#include <kern/mman.h>
+#include <lib.h>
+#include <syscall.h>
+#include <thread.h>
+#include <curthread.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <elf.h>
+#include <vm.h>
+#include <addrspace.h>
+
+/*
+	Mapped files. A mapping is a region of the address space like the segments of the
+	executable: its pages are read from the file by vm_fault the first time they are touched.
+	Unlike a segment it is writable and shared with the file, so page_out writes dirty pages
+	back to the file instead of to swap. Mappings are placed one below the other, down from
+	the bottom of the stack; the heap may grow up to the lowest one (as->mmap_base).
+
+	There is no open file table yet, so the file is named by its path.
+*/
+
+/*
+	the mapping that starts at addr, NULL if there isn't one. *prevp gets the region before it
+*/
+static struct region_array *find_mapping(struct addrspace *as, vaddr_t addr, struct region_array **prevp){
+	struct region_array *region, *prev = NULL;
+
+	for(region = as->regions; region != NULL; prev = region, region = region->next){
+		if(region->mapped && region->va == addr)
+			break;
+	}
+	*prevp = prev;
+	return region;
+}
+
+/*
+	Error codes from the MAN pages:
+
+	EINVAL	length is 0, or offset is not a multiple of the page size.
+	ENOMEM	There is no room left in the address space for the mapping, or the part of it
+		past the end of the file doesn't fit in what is left to reserve (see vm/oom.c).
+	ENODEV	The file is a device; devices can't be mapped.
+	EFAULT	path points outside the address space.
+	and whatever vfs_open returns for the path.
+*/
+int sys_mmap(userptr_t path, size_t length, int prot, off_t offset, int *retval){
+	struct addrspace *as = curthread->t_vmspace;
+	struct region_array *region;
+	struct vnode *vn;
+	struct stat st;
+	char *kpath;
+	size_t len, filesize, avail;
+	unsigned long charge;
+	vaddr_t va;
+	int result;
+
+	if(length == 0 || offset < 0 || (offset & ~(off_t)PAGE_FRAME) != 0)
+		return EINVAL;
+	if((prot & ~(PROT_READ | PROT_WRITE)) != 0)
+		return EINVAL;
+
+	len = ROUNDUP(length, PAGE_SIZE);
+	if(len < length || len > as->mmap_base - as->heap_end)
+		return ENOMEM;
+	va = as->mmap_base - len;
+
+	kpath = kmalloc(PATH_MAX);
+	if(kpath == NULL)
+		return ENOMEM;
+	result = copyinstr(path, kpath, PATH_MAX, NULL);
+	if(result){
+		kfree(kpath);
+		return result;
+	}
+
+	result = vfs_open(kpath, (prot & PROT_WRITE) ? O_RDWR : O_RDONLY, &vn);
+	kfree(kpath);
+	if(result)
+		return result;
+
+	result = VOP_MMAP(vn);
+	if(result == 0)
+		result = VOP_STAT(vn, &st);
+	if(result){
+		vfs_close(vn);
+		return result;
+	}
+
+	filesize = 0;
+	if(st.st_size > offset){
+		avail = st.st_size - offset;
+		filesize = avail < length ? avail : length;
+	}
+
+	//only the part past the end of the file may need swap (see region_charge)
+	charge = (prot & PROT_WRITE) ? (len - ROUNDUP(filesize, PAGE_SIZE)) / PAGE_SIZE : 0;
+	result = vm_reserve(as, charge);
+	if(result == 0){
+		result = as_define_region(as, va, len, PF_R, (prot & PROT_WRITE) ? PF_W : 0, 0);
+		if(result)
+			vm_unreserve(as, charge);
+	}
+	if(result){
+		vfs_close(vn);
+		return result;
+	}
+
+	//the region holds on to the vnode like an executable's segments do
+	VOP_INCREF(vn);
+	vfs_close(vn);
+
+	region = as->last_region;
+	region->vn = vn;
+	region->offset = offset;
+	region->file_va = va;
+	region->filesize = filesize;
+	region->super = 0;
+	region->mapped = 1;
+
+	as->mmap_base = va;
+	*retval = va;
+	return 0;
+}
+
+/*
+	writes the mapping at addr back to its file and removes it. Its pages are released like
+	the heap's when it shrinks
+*/
+int sys_munmap(vaddr_t addr, size_t length){
+	struct addrspace *as = curthread->t_vmspace;
+	struct region_array *region, *prev, *r;
+	vaddr_t end;
+
+	region = find_mapping(as, addr, &prev);
+	if(region == NULL || ROUNDUP(length, PAGE_SIZE) != region->num_pages*PAGE_SIZE)
+		return EINVAL;
+	end = region->va + region->num_pages*PAGE_SIZE;
+
+	mmap_sync(as, region, region->va, end);
+	pt_clear_range(as, region->va, end);
+	vm_unreserve(as, region_charge(region));
+
+	if(prev == NULL)
+		as->regions = region->next;
+	else
+		prev->next = region->next;
+	if(as->last_region == region)
+		as->last_region = prev;
+	VOP_DECREF(region->vn);
+	kfree(region);
+
+	//the space below the stack is only handed out again once everything below it is gone
+	as->mmap_base = as->stack_begin;
+	for(r = as->regions; r != NULL; r = r->next){
+		if(r->mapped && r->va < as->mmap_base)
+			as->mmap_base = r->va;
+	}
+	return 0;
+}
+
+/*
+	writes the changed pages of the mapping in [addr, addr+length) back to the file
+*/
+int sys_msync(vaddr_t addr, size_t length){
+	struct addrspace *as = curthread->t_vmspace;
+	struct region_array *region;
+
+	if((addr & ~(vaddr_t)PAGE_FRAME) != 0)
+		return EINVAL;
+	for(region = as->regions; region != NULL; region = region->next){
+		if(region->mapped && addr >= region->va && addr < region->va + region->num_pages*PAGE_SIZE)
+			break;
+	}
+	if(region == NULL || length > region->va + region->num_pages*PAGE_SIZE - addr)
+		return ENOMEM;
+
+	return mmap_sync(as, region, addr, addr + length);
+}
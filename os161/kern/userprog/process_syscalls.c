@@ -3,6 +3,8 @@
 #include <curthread.h>
 #include <kern/errno.h>
 #include <kern/unistd.h>
+#include <kern/vmstat.h>
+#include <kern/kheapstat.h>
 #include <machine/trapframe.h>
 #include <lib.h>
 #include <machine/spl.h>
@@ -11,6 +13,18 @@
 #include <addrspace.h>
 
 
+/*
+	the copy of the parent's trapframe sys_fork hands to md_forkentry
+*/
+struct kmem_cache *trapframe_cache;
+
+void fork_bootstrap(void){
+	trapframe_cache = kmem_cache_create("trapframe", sizeof(struct trapframe), NULL);
+	if(trapframe_cache == NULL){
+		panic("fork_bootstrap: Out of memory\n");
+	}
+}
+
 int sys_getpid(int *retval){
 	*retval = curthread->t_pid;
 	return 0;
@@ -30,7 +44,7 @@ int sys_fork(struct trapframe *tf, int *retval){
 
 	struct trapframe* child_tf;
 
-	child_tf = kmalloc(sizeof(struct trapframe));
+	child_tf = kmem_cache_alloc(trapframe_cache);
 	if(child_tf == NULL){
 		return ENOMEM;
 	}
@@ -42,7 +56,7 @@ int sys_fork(struct trapframe *tf, int *retval){
 
 	int ret = as_copy(curthread->t_vmspace, &child_as);
 	if(ret){
-		kfree(child_tf);
+		kmem_cache_free(trapframe_cache, child_tf);
 		return ENOMEM;
 	}
 
@@ -51,8 +65,8 @@ int sys_fork(struct trapframe *tf, int *retval){
 	ret = thread_fork(curthread->t_name, child_tf, (unsigned long)child_as, md_forkentry, &child_thread);
 
     if(ret) {
-        kfree(child_tf);
-        kfree(child_as);
+        kmem_cache_free(trapframe_cache, child_tf);
+        as_destroy(child_as);
         return ret;
     }
 
@@ -99,14 +113,6 @@ int sys_execv(const char *program, char **args){
     return 0;
 }
 
-void free_last_n_pages(struct pte *cur){
-	if(cur == NULL)
-		return;
-	free_last_n_pages(cur->next);
-	free_kpages(cur->va);
-	return;
-}
-
 int sys_sbrk(intptr_t amount, int *retval){
 	struct addrspace *as = curthread->t_vmspace;
 
@@ -121,61 +127,21 @@ int sys_sbrk(intptr_t amount, int *retval){
 	}
 	//kprintf("amount: %lu \n", amount);
 	if (amount > 0) {
-		if ((amount + as->heap_end) > as->stack_begin) {
+		//the heap grows up to the lowest mapped file (or the stack, if nothing is mapped)
+		if ((amount + as->heap_end) > as->mmap_base) {
 			*retval = -1;
 			return ENOMEM;
 		}
 
-		// First, check if we need to allocate more pages else don't need to add more pages- use what you have! :P
-		if ((amount + as->heap_end) > (as->last_heap->va + PAGE_SIZE)){
-
-			intptr_t sub_amount = 0;
-
-			if (as->heap_end > as->last_heap->va)
-				sub_amount = (as->last_heap->va + PAGE_SIZE - as->heap_end);
-
-			int num_pages = (amount-sub_amount) / PAGE_SIZE;
-			if ((amount-sub_amount) % PAGE_SIZE != 0) {
-				num_pages += 1;
-			}
-
-			/*
-			if(as->heap_begin == as->heap_end){
-				num_pages -= 1;
-			}
-			*/
-			
-			if ((unsigned)num_pages > pages_avail) {
-				*retval = -1;
-				return ENOMEM;
-			}
-
-			struct pte *heap = as->last_heap;
-			int i;
-			for (i = 0; i < num_pages; i++) {
-				heap->next = (struct pte *)kmalloc(sizeof(struct pte));
-				heap = heap->next;
-
-				/*
-				paddr_t pa = KVADDR_TO_PADDR(alloc_upages(1, curthread->t_vmspace));
-				if (pa == 0) {
-					*retval = -1;
-					return ENOMEM;
-				}*/
-
-				heap->va = as->last_heap->va + (i+1)*PAGE_SIZE;
-
-				paddr_t pa = demand_page(heap, as);
-				assert(pa != 0);
-
-				heap->pa = pa;
-				heap->on_mem = 1;
-				heap->next = NULL;
-
-				assert((heap->va & PAGE_FRAME)==heap->va);
-			}
-			as->last_heap = heap;
+		//the new pages have to fit in RAM and swap, or we say so now rather than at the fault
+		if (vm_reserve(as, (ROUNDUP(as->heap_end + amount, PAGE_SIZE) - ROUNDUP(as->heap_end, PAGE_SIZE)) / PAGE_SIZE)) {
+			*retval = -1;
+			return ENOMEM;
 		}
+
+		// growing the heap only moves heap_end: vm_fault gives each new page a zeroed
+		// frame the first time it is touched. If the address space uses superpages, every
+		// aligned SUPERPAGE_SIZE chunk of the new heap is mapped whole on its first touch
 	}
 	else{	//amount is negative!
 		if ((long)as->heap_begin > (long)amount + (long)as->heap_end){
@@ -183,48 +149,33 @@ int sys_sbrk(intptr_t amount, int *retval){
 			return EINVAL;
 		}
 
-		intptr_t abs_amount = amount*-1;
-		// First, check if we need to allocate more pages else don't need to add more pages- use what you have! :P
-		if ((amount + as->heap_end) <= as->last_heap->va){
-			intptr_t sub_amount = 0;
-
-			if (as->heap_end > as->last_heap->va)
-				sub_amount = (as->heap_end - as->last_heap->va);
-
-			int num_pages = (abs_amount-sub_amount) / PAGE_SIZE;
-			if ((abs_amount-sub_amount) % PAGE_SIZE != 0) {
-				num_pages += 1;
-			}
-
-
-			// You know that interview question where they ask you to find the nth last element in a linked list?
-			// Yeah, that's how you do ittt!
-			
-			struct pte *heap, *nth_last_heap;
-			heap = as->heap;
-			nth_last_heap = as->heap;
-			
-			int counter = num_pages;
-			while(counter--){
-				heap = heap->next;
-			}
-			assert(heap != NULL);
-
-			while(heap != as->last_heap){
-				heap = heap->next;
-				nth_last_heap = nth_last_heap->next;
-			}
-
-			//now free the last num_pages of the heap
-
-			free_last_n_pages(nth_last_heap->next);
-			nth_last_heap->next = NULL;
-			
-			//remember to update last_heap
-			as->last_heap = nth_last_heap;
-		}
+		//free every page that no longer holds any part of the heap
+		pt_clear_range(as, ROUNDUP(as->heap_end + amount, PAGE_SIZE), as->heap_end);
+		vm_unreserve(as, (ROUNDUP(as->heap_end, PAGE_SIZE) - ROUNDUP(as->heap_end + amount, PAGE_SIZE)) / PAGE_SIZE);
 	}
 	*retval = as->heap_end;		//according to the man pages, retval = previous heap end
 	as->heap_end += amount;
 	return 0;
 }
+
+int sys_vmstat(userptr_t buf){
+	struct vmstat vs;
+
+	vm_getstat(curthread->t_vmspace, &vs);
+	return copyout(&vs, buf, sizeof(struct vmstat));
+}
+
+int sys_kheapstat(userptr_t buf){
+	struct kheapstat *ks;
+	int result;
+
+	//too big for the kernel stack
+	ks = kmalloc(sizeof(struct kheapstat));
+	if(ks == NULL){
+		return ENOMEM;
+	}
+	kheap_getstat(ks);
+	result = copyout(ks, buf, sizeof(struct kheapstat));
+	kfree(ks);
+	return result;
+}
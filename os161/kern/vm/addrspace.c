@@ -5,47 +5,156 @@
 #include <curthread.h>
 #include <addrspace.h>
 #include <vm.h>
+#include <elf.h>
+#include <vnode.h>
 #include <machine/spl.h>
 #include <machine/tlb.h>
 
+/*
+	address space IDs. An address space gets one the first time it is activated in a
+	generation and keeps it until they run out; then the TLB is flushed and a new generation
+	starts, so everybody picks a fresh one the next time they run. ASID 0 is never handed out
+*/
+static u_int32_t asid_next = 1;
+unsigned long asid_generation = 1;
+u_int32_t cur_asid;
+
+/*
+	address spaces and level 2 page tables are made and thrown away on every fork, exec and
+	exit, so they come from caches of their own. A level 2 table fills a page, so its cache
+	hands out whole pages and keeps a few freed ones
+*/
+static struct kmem_cache *as_cache;
+static struct kmem_cache *pt_cache;
+
+void
+as_bootstrap(void)
+{
+	as_cache = kmem_cache_create("addrspace", sizeof(struct addrspace), NULL);
+	pt_cache = kmem_cache_create("pagetable", PT_L2_ENTRIES * sizeof(struct pte), NULL);
+	if (as_cache == NULL || pt_cache == NULL) {
+		panic("as_bootstrap: Out of memory\n");
+	}
+}
 
 struct addrspace *
 as_create(void)
 {
-	struct addrspace *as = kmalloc(sizeof(struct addrspace));
+	struct addrspace *as = kmem_cache_alloc(as_cache);
 	if (as==NULL) {
 		return NULL;
 	}
 
-	as->pages = NULL;
+	as->pt = kmalloc(PT_L1_ENTRIES * sizeof(struct pte *));
+	if (as->pt == NULL) {
+		kmem_cache_free(as_cache, as);
+		return NULL;
+	}
+	bzero(as->pt, PT_L1_ENTRIES * sizeof(struct pte *));
+
 	as->regions = NULL;
+	as->last_region = NULL;
+	as->stack_begin = as->stack_end = 0;
+	as->heap_begin = as->heap_end = 0;
+	as->mmap_base = 0;
+	as->asid = 0;
+	as->asid_gen = 0;
+	as->superpages = vm_superpages;
+	as->rss = 0;
+	as->minflt = as->majflt = 0;
+	as->swapins = as->swapouts = 0;
+	as->swapped = 0;
+	as->reserved = 0;
 
 	return as;
 }
 
+/*
+	returns the pte that maps va. Level 2 tables are allocated on demand when create is set
+*/
+struct pte *
+pt_lookup(struct addrspace *as, vaddr_t va, int create)
+{
+	struct pte *l2;
+
+	assert(va < USERTOP);
+
+	l2 = as->pt[PT_L1_INDEX(va)];
+	if (l2 == NULL) {
+		if (!create) {
+			return NULL;
+		}
+		l2 = kmem_cache_alloc(pt_cache);
+		if (l2 == NULL) {
+			return NULL;
+		}
+		bzero(l2, PT_L2_ENTRIES * sizeof(struct pte));
+		as->pt[PT_L1_INDEX(va)] = l2;
+	}
+	return &l2[PT_L2_INDEX(va)];
+}
+
+/*
+	releases the pages mapped in [start, end) and forgets about them
+*/
+void
+pt_clear_range(struct addrspace *as, vaddr_t start, vaddr_t end)
+{
+	struct pte *entry;
+	vaddr_t va;
+	cmap_lock();
+
+	for (va = start & PAGE_FRAME; va < end; va += PAGE_SIZE) {
+		entry = pt_lookup(as, va, 0);
+		if (entry == NULL) {
+			continue;
+		}
+		if (entry->on_mem || entry->on_disk) {
+			page_release(as, va, entry);
+		}
+	}
+	cmap_unlock();
+}
+
 void
 as_destroy(struct addrspace *as)
 {
 	if (as != NULL) {
-		struct region_array *current_region = as->regions;
+		struct region_array *current_region;
 		struct region_array *next_region;
+
+		//what a mapped file still has in memory goes back to the file first
+		for (current_region = as->regions; current_region != NULL; current_region = current_region->next) {
+			if (current_region->mapped) {
+				mmap_sync(as, current_region, current_region->va,
+					  current_region->va + current_region->num_pages * PAGE_SIZE);
+			}
+		}
+
+		//give back every frame and swap slot the address space still holds
+		free_all_pages(as);
+		vm_unreserve(as, as->reserved);
+
+		current_region = as->regions;
 		while(current_region != NULL){
 			next_region = current_region->next;
+			if(current_region->vn != NULL)
+				VOP_DECREF(current_region->vn);
 			kfree(current_region);
 			current_region = next_region;
 		}
 		as->regions = NULL;
 
-		struct pte *current_pte = as->pages;
-		struct pte *next_pte;
-		while (current_pte != NULL){
-			next_pte = current_pte->next;
-			kfree(current_pte);
-			current_pte = next_pte;
+		unsigned i;
+		for (i = 0; i < PT_L1_ENTRIES; i++) {
+			if (as->pt[i] != NULL) {
+				kmem_cache_free(pt_cache, as->pt[i]);
+			}
 		}
-		as->pages = NULL;
+		kfree(as->pt);
+		as->pt = NULL;
 	}
-	kfree(as);
+	kmem_cache_free(as_cache, as);
 }
 
 void
@@ -53,13 +162,26 @@ as_activate(struct addrspace *as)
 {
 	int i, spl;
 
-	(void)as;
-
 	spl = splhigh();
 
-	for (i=0; i<NUM_TLB; i++) {
-		TLB_Write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	if (as == NULL) {
+		cur_asid = 0;
 	}
+	else {
+		if (as->asid_gen != asid_generation) {
+			if (asid_next == NUM_PID) {
+				for (i=0; i<NUM_TLB; i++) {
+					TLB_Write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+				}
+				asid_generation++;
+				asid_next = 1;
+			}
+			as->asid = asid_next++;
+			as->asid_gen = asid_generation;
+		}
+		cur_asid = as->asid;
+	}
+	TLB_SetPID(cur_asid);
 
 	splx(spl);
 }
@@ -68,72 +190,124 @@ int
 as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 		 int readable, int writeable, int executable)
 {
-	size_t npages; 
+	struct region_array *region;
+	size_t npages;
 
-	// Align the region. First, the base... 
+	// Align the region. First, the base...
 	sz += vaddr & ~(vaddr_t)PAGE_FRAME;
 	vaddr &= PAGE_FRAME;
 	assert((vaddr&PAGE_FRAME) == vaddr);
 
-	// ...and now the length. 
+	// ...and now the length.
 	sz = (sz + PAGE_SIZE - 1) & PAGE_FRAME;
 
 	npages = sz / PAGE_SIZE;
 
 	//need to allocate a new region_array element
-	//struct region_array *last_elem;
+	region = (struct region_array *) kmalloc(sizeof(struct region_array));
+	if (region == NULL) {
+		return ENOMEM;
+	}
+	region->next = NULL;	//end of linked list
 
 	if(as->regions == NULL){
-		as->regions = (struct region_array *) kmalloc(sizeof(struct region_array));
-		as->regions->next = NULL;	//end of linked list
+		as->regions = region;
 		as->last_region = as->regions;	//first element in the linked list is the last element!
 	}
 	else{
-		as->last_region->next = (struct region_array *) kmalloc(sizeof(struct region_array));
+		as->last_region->next = region;
 		as->last_region = as->last_region->next;
-		as->last_region->next = NULL;	//end of linked list		as->regions->last = last_elem;
 	}
 
 	as->last_region->pa = 0;
 	as->last_region->va = vaddr;
 	as->last_region->rwx = (readable | writeable | executable); //((readable&1)<<2) | ((writeable&1)<<1) | (executable&1);
 	as->last_region->num_pages = npages;
+	as->last_region->vn = NULL;
+	as->last_region->offset = 0;
+	as->last_region->file_va = vaddr;
+	as->last_region->filesize = 0;
+	as->last_region->super = as->superpages && npages >= SUPERPAGE_PAGES;
+	as->last_region->mapped = 0;
 
 	return 0;
 }
 
+/*
+	the pages of region that count against the commit limit (see vm/oom.c): the writable ones,
+	except those a mapped file keeps on disk itself
+*/
+unsigned long
+region_charge(struct region_array *region)
+{
+	if (!(region->rwx & PF_W)) {
+		return 0;
+	}
+	if (region->mapped) {
+		return region->num_pages - DIVROUNDUP(region->filesize, PAGE_SIZE);
+	}
+	return region->num_pages;
+}
+
+/*
+	the region defined at vaddr holds filesize bytes of v from offset on, the rest is zero.
+	Nothing is read here: vm_fault reads each page the first time it is touched
+*/
 int
-as_prepare_load(struct addrspace *as)
+as_define_file(struct addrspace *as, struct vnode *v, off_t offset,
+	       vaddr_t vaddr, size_t memsize, size_t filesize)
 {
 	struct region_array *region;
-	size_t i;
-	vaddr_t va;
 
-	region = as->regions;
-	while(region != NULL){
+	if (filesize > memsize) {
+		kprintf("ELF: warning: segment filesize > segment memsize\n");
+		filesize = memsize;
+	}
+	if (vaddr >= USERTOP || memsize > USERTOP - vaddr) {
+		return EFAULT;
+	}
 
-		va = region->va;
-		assert(va == (va & PAGE_FRAME));
-		for(i = 0; i < region->num_pages; i++){
-			if(as->pages==NULL){
-				as->pages = (struct pte *) kmalloc(sizeof(struct pte));
-				as->last_page = as->pages;
-			}
-			else{
-				as->last_page->next = (struct pte *) kmalloc(sizeof(struct pte));
-				as->last_page = as->last_page->next;
-			}
-			struct pte *last = as->last_page;
-			
-			last->pa = 0;
-			last->va = va;
-			last->rwx = region->rwx;
-			last->on_mem = 0;
-			last->on_disk = 0;
-			last->next = NULL;	//end of pte linked list
-			va += PAGE_SIZE;
+	for (region = as->regions; region != NULL; region = region->next) {
+		if (region->va == (vaddr & PAGE_FRAME) && region->vn == NULL) {
+			break;
 		}
-		region = region->next;
+	}
+	if (region == NULL) {
+		return EINVAL;
+	}
+
+	VOP_INCREF(v);
+	region->vn = v;
+	region->offset = offset;
+	region->file_va = vaddr;
+	region->filesize = filesize;
+	return 0;
+}
+
+/*
+	no ptes are built here any more: they are created by vm_fault the first time a page is
+	touched. We only need to work out where the stack and the heap are, and reserve memory
+	for the writable regions and the stack
+*/
+int
+as_prepare_load(struct addrspace *as)
+{
+	struct region_array *region;
+	vaddr_t va = 0;
+	unsigned long charge = VM_STACKPAGES;
+	int result;
+
+	for (region = as->regions; region != NULL; region = region->next) {
+		assert(region->va == (region->va & PAGE_FRAME));
+		if (region->va + region->num_pages * PAGE_SIZE > va) {
+			va = region->va + region->num_pages * PAGE_SIZE;
+		}
+		charge += region_charge(region);
+	}
+
+	result = vm_reserve(as, charge);
+	if (result) {
+		return result;
 	}
 
 	vaddr_t stackva = USERSTACK - VM_STACKPAGES* PAGE_SIZE;
@@ -142,49 +316,9 @@ as_prepare_load(struct addrspace *as)
 
 	assert((stackva & PAGE_FRAME) == stackva);
 
-	struct pte* last = as->last_page;
-	struct pte *stack_page;
-
-	for( i = 0; i < VM_STACKPAGES; i++){
-		stack_page = (struct pte *) kmalloc(sizeof(struct pte));
-		last->next = stack_page;
-
-		stack_page->pa = 0;
-		stack_page->va = stackva;
-		stack_page->next = NULL;
-		stack_page->on_mem = 0;
-		stack_page->on_disk = 0;
-		if(i == 0){
-			as->stack = stack_page;
-		}
-
-		stackva += PAGE_SIZE;
-		last = last->next;
-	}
-	as->last_stack = last;
-
-	struct pte *heap_page = (struct pte *) kmalloc(sizeof(struct pte));
-	last->next = heap_page;
-	/*
-	paddr_t pa = demand_page(heap_page, as);//KVADDR_TO_PADDR(alloc_upages(1, curthread->t_vmspace));	//allocate one page
-	if(pa == 0){
-		return ENOMEM;	//oops ran out of memory!!! :'(
-	}
-	kprintf("U: %x alloc_u'ed a page %d\n",curthread->t_vmspace, pa);
-	//assert(as == curthread->t_vmspace);
-	//heap_page->as = as;
-	heap_page->pa = pa;
-	*/
-	heap_page->pa = 0;
-	heap_page->va = va;
-	heap_page->on_mem = 0;
-	heap_page->on_disk = 0;
-	heap_page->next = NULL;
-
-	as->heap = heap_page;
-	as->last_heap = heap_page;
-	as->heap_begin = va;	//at first, the heap occupies a single page
+	as->heap_begin = va;	//at first, the heap is empty and starts right after the last region
 	as->heap_end = va;
+	as->mmap_base = stackva;	//files are mapped downwards from just below the stack
 
 	return 0;
 }
@@ -199,6 +333,7 @@ as_complete_load(struct addrspace *as)
 int
 as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 {
+	(void)as;
 
 	*stackptr = USERSTACK;
 	return 0;
@@ -206,162 +341,113 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 
 
 /*
-	if as has old has a copy on disk, make a copy on disk
+	walks the old page table and shares every page the old address space has (on memory or
+	on disk) with the new one. Nothing is copied: both sides map the pages read-only and
+	vm_fault gives a private copy to whoever writes first. Mapped files are the exception:
+	the parent's dirty pages are written back and the child reads them from the file itself
 */
 int
-as_copy(volatile struct addrspace *old, volatile struct addrspace **ret)
+as_copy(struct addrspace *old, struct addrspace **ret)
 {
-	//kprintf("as_copy: old as = %x new_as = %x\n", old, *ret);
-	//kprintf("\r");
-	int spl = splhigh();
-	volatile struct addrspace *new;
-
-	new = as_create();
-	if (new == NULL) {
-		return ENOMEM;
-	}
-
+	cmap_lock();
+	struct addrspace *new;
 	struct region_array *region, *new_region;
 
-	region = old->regions;
-	while(region != NULL){
-		if((new)->regions != NULL){
-			new_region = (new)->last_region;
-			
-			new_region->next = (struct region_array *) kmalloc(sizeof(struct region_array));
-			new_region = new_region->next;
-
-			(new)->last_region = new_region;
-		}
-		else{
-			(new)->regions = (struct region_array *) kmalloc(sizeof(struct region_array));
-			(new)->last_region = (new)->regions;
-			new_region = (new)->regions;
+	for (region = old->regions; region != NULL; region = region->next) {
+		if (region->mapped) {
+			mmap_sync(old, region, region->va, region->va + region->num_pages * PAGE_SIZE);
 		}
-
-		new_region->pa = region->pa;
-		new_region->va = region->va;
-		new_region->rwx = region->rwx;
-		new_region->num_pages = region->num_pages;
-		new_region->next = NULL;
-
-		region = region->next;
 	}
 
-	if (as_prepare_load(new)) {
-		as_destroy(new);
-		splx(spl);
+	new = as_create();
+	if (new == NULL) {
+		cmap_unlock();
 		return ENOMEM;
 	}
 
-	volatile struct pte *old_page, *new_page;
-	old_page = old->pages;
-	new_page = (new)->pages;
-	while(old_page != NULL){
-
-		paddr_t pa;
-
-		if((old_page->on_disk == 1) && (old_page->on_mem == 0)){
-			//kprintf("%d is on disk, let's load  it\n", old_page->va);
-			pa = load_page(old_page, old, VM_FAULT_WRITE);	//load the old page on memory
-		}
-
-		if(old_page->on_mem == 1){
-			//kprintf("%d is on mem, let's copy\n",old_page->va);
-			pa = demand_page(new_page, new);
-			assert(pa != 0);
-			new_page->pa = pa;
-			new_page->on_mem = 1;
-		}
-
-		memmove((void *)PADDR_TO_KVADDR(new_page->pa),
-			(const void *)PADDR_TO_KVADDR(old_page->pa),PAGE_SIZE);
-
-		old_page = old_page->next;
-		new_page = new_page->next;
-	}
-
-	*ret = new;
-	splx(spl);
-	return 0;
-}
-
-/*
-	if as has old has a copy on disk, make a copy on disk
-
-int
-as_copy(struct addrspace *old, struct addrspace **new)
-{
-	//kprintf("as_copy: old as = %x new_as = %x\n", old, *new);
-	//kprintf("\r");
-	int spl = splhigh();
-	//struct addrspace *new;
-
-	*new = as_create();
-	if (*new == NULL) {
+	//the child may come to need as much as the parent
+	if (vm_reserve(new, old->reserved)) {
+		as_destroy(new);
+		cmap_unlock();
 		return ENOMEM;
 	}
 
-	struct region_array *region, *new_region;
-
 	region = old->regions;
 	while(region != NULL){
-		if((*new)->regions != NULL){
-			new_region = (*new)->last_region;
-			
-			new_region->next = (struct region_array *) kmalloc(sizeof(struct region_array));
-			new_region = new_region->next;
-
-			(*new)->last_region = new_region;
+		new_region = (struct region_array *) kmalloc(sizeof(struct region_array));
+		if (new_region == NULL) {
+			as_destroy(new);
+			cmap_unlock();
+			return ENOMEM;
+		}
+		if(new->regions != NULL){
+			new->last_region->next = new_region;
+			new->last_region = new_region;
 		}
 		else{
-			(*new)->regions = (struct region_array *) kmalloc(sizeof(struct region_array));
-			(*new)->last_region = (*new)->regions;
-			new_region = (*new)->regions;
+			new->regions = new_region;
+			new->last_region = new->regions;
 		}
 
 		new_region->pa = region->pa;
 		new_region->va = region->va;
 		new_region->rwx = region->rwx;
 		new_region->num_pages = region->num_pages;
+		new_region->vn = region->vn;
+		new_region->offset = region->offset;
+		new_region->file_va = region->file_va;
+		new_region->filesize = region->filesize;
+		new_region->super = region->super;
+		new_region->mapped = region->mapped;
+		if(new_region->vn != NULL)
+			VOP_INCREF(new_region->vn);
 		new_region->next = NULL;
 
 		region = region->next;
 	}
 
-	if (as_prepare_load(*new)) {
-		as_destroy(*new);
-		splx(spl);
-		return ENOMEM;
-	}
-
-	struct pte *old_page, *new_page;
-	old_page = old->pages;
-	new_page = (*new)->pages;
-	while(old_page != NULL){
-
-		paddr_t pa;
-
-		if((old_page->on_disk == 1) && (old_page->on_mem == 0)){
-			pa = load_page(old_page, old);	//load the old page on memory
-		}
-
-		if(old_page->on_mem){
-			pa = demand_page(new_page, *new);
-			assert(pa != 0);
-			new_page->pa = pa;
-			new_page->on_mem = 1;
+	new->superpages = old->superpages;
+	new->stack_begin = old->stack_begin;
+	new->stack_end = old->stack_end;
+	new->heap_begin = old->heap_begin;
+	new->heap_end = old->heap_end;
+	new->mmap_base = old->mmap_base;
+
+	unsigned i, j;
+	for (i = 0; i < PT_L1_ENTRIES; i++) {
+		if (old->pt[i] == NULL) {
+			continue;
 		}
+		for (j = 0; j < PT_L2_ENTRIES; j++) {
+			struct pte *old_page = &old->pt[i][j];
+			struct pte *new_page;
+			vaddr_t va = PT_VADDR(i, j);
 
-		memmove((void *)PADDR_TO_KVADDR(new_page->pa),
-			(const void *)PADDR_TO_KVADDR(old_page->pa),PAGE_SIZE);
+			if (!old_page->on_mem && !old_page->on_disk) {
+				continue;
+			}
+			if (old_page->on_mem && mapped_region(old, va) != NULL) {
+				continue;
+			}
 
-		old_page = old_page->next;
-		new_page = new_page->next;
+			new_page = pt_lookup(new, va, 1);
+			if (new_page == NULL) {
+				as_destroy(new);
+				cmap_unlock();
+				return ENOMEM;
+			}
+			if (page_share(old_page, new_page, new, va)) {
+				as_destroy(new);
+				cmap_unlock();
+				return ENOMEM;
+			}
+		}
 	}
 
-	//*ret = new;
-	splx(spl);
+	//the parent may have writable entries for pages that are now shared
+	tlb_invalidate_as(old);
+
+	*ret = new;
+	cmap_unlock();
 	return 0;
 }
-*/
\ No newline at end of file
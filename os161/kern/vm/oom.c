@@ -0,0 +1,147 @@
+/*
+ * Memory pressure.
+ *
+ * Commit accounting: every address space reserves, up front, the
+ * anonymous memory it may come to need - its writable regions, its
+ * stack and its heap, but not text or the parts of mapped files that
+ * the file itself backs - against vm_commit_limit, which is what RAM
+ * and swap can hold between them. exec, fork, sbrk and mmap fail with
+ * ENOMEM when the reservation doesn't fit, so a program that asks for
+ * too much is told so while it can still cope, instead of the system
+ * running out under everybody's feet later.
+ *
+ * The reservations are only an estimate (the kernel heap lives in RAM
+ * too, and shared copy-on-write pages are charged to every sharer), so
+ * memory can still run out. When a fault finds RAM and swap both full,
+ * the OOM killer picks the process with the most pages in RAM and swap
+ * and marks it killed. It exits in oom_check the next time it is on its
+ * way back to user mode, and the fault is tried again. If the faulting
+ * process is the largest one, its fault fails and it is killed by the
+ * trap code like any other bad access. Only one kill is pending at a
+ * time: faults that run out while the victim is still on its way out
+ * wait for it rather than pick another one.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <thread.h>
+#include <curthread.h>
+#include <syscall.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <machine/spl.h>
+
+/* times oom_kill yields to its victim before it waits a second for it */
+#define OOM_YIELDS 16
+
+unsigned long vm_committed;		//pages reserved by all address spaces
+unsigned long vm_commit_limit;		//set by vm_bootstrap
+unsigned long vm_oom_kills;
+
+static int oom_victim = -1;		//pid of the last process killed, until it has exited
+
+/*
+	charges npages more to as. Returns ENOMEM if they don't fit under vm_commit_limit
+*/
+int vm_reserve(struct addrspace *as, unsigned long npages){
+	int spl = splhigh();
+
+	if(npages > vm_commit_limit - vm_committed){
+		splx(spl);
+		return ENOMEM;
+	}
+	vm_committed += npages;
+	as->reserved += npages;
+	splx(spl);
+	return 0;
+}
+
+void vm_unreserve(struct addrspace *as, unsigned long npages){
+	int spl = splhigh();
+
+	assert(as->reserved >= npages && vm_committed >= npages);
+	vm_committed -= npages;
+	as->reserved -= npages;
+	splx(spl);
+}
+
+/*
+	what killing the process would give back
+*/
+static unsigned long oom_badness(struct addrspace *as){
+	return as->rss + as->swapped;
+}
+
+/*
+	whether the last process killed still hasn't exited. Its slot keeps killed set until the
+	pid is handed out again, and p_thread is cleared when it exits
+*/
+static int oom_pending(void){
+	return oom_victim >= 0 && process_table[oom_victim].killed && process_table[oom_victim].p_thread != NULL;
+}
+
+/*
+	called by vm_fault when RAM and swap are full. Kills the largest process, unless the last
+	one killed hasn't exited yet, in which case that is the one waited for. Returns 1 once the
+	victim had its chance to exit, so the fault can be tried again, or 0 if the fault should
+	fail: the current process is the one to go, or there is nobody to kill. Call without the
+	coremap lock
+*/
+int oom_kill(void){
+	struct thread *t;
+	unsigned long size, worst = 0;
+	int i, n, victim = -1, spl;
+
+	if(process_table[curthread->t_pid].killed)
+		return 0;
+
+	spl = splhigh();
+	if(oom_pending()){
+		victim = oom_victim;
+		t = process_table[victim].p_thread;
+	}
+	else{
+		for(i = PID_MIN; i < MAX_PROCESSES; i++){
+			t = process_table[i].p_thread;
+			if(t == NULL || t->t_vmspace == NULL || process_table[i].killed)
+				continue;
+			size = oom_badness(t->t_vmspace);
+			if(victim < 0 || size > worst){
+				victim = i;
+				worst = size;
+			}
+		}
+		if(victim < 0){
+			splx(spl);
+			return 0;
+		}
+
+		t = process_table[victim].p_thread;
+		process_table[victim].killed = 1;
+		oom_victim = victim;
+		vm_oom_kills++;
+		kprintf("oom: out of memory, killed process %d (%s) with %lu pages in RAM and %lu in swap\n",
+			victim, t->t_name, t->t_vmspace->rss, t->t_vmspace->swapped);
+	}
+	if(t == curthread){
+		splx(spl);
+		return 0;
+	}
+
+	//it exits as soon as it runs, unless it is asleep in the kernel
+	for(n = 0; n < OOM_YIELDS && process_table[victim].p_thread == t; n++)
+		thread_yield();
+	if(process_table[victim].p_thread == t)
+		clocksleep(1);
+	splx(spl);
+	return 1;
+}
+
+/*
+	called by the trap code on the way back to user mode: a process the OOM killer picked exits
+*/
+void oom_check(void){
+	if(curthread != NULL && curthread->t_vmspace != NULL && process_table[curthread->t_pid].killed)
+		sys__exit(ENOMEM);
+}
@@ -0,0 +1,91 @@
+/*
+ * Text page cache.
+ *
+ * Pages of read-only segments only ever hold what the executable has,
+ * so every process running the same binary can map the same frame.
+ * Frames read in for such pages are entered here, keyed by the
+ * executable's vnode and the virtual address of the page (which the
+ * ELF file fixes). Before vm_fault reads a text page from the file it
+ * looks here first, and if the page is resident it just becomes one
+ * more mapping of the frame (see cmap[].sharers and refcount).
+ *
+ * A frame leaves the cache when its last mapping goes away or when it
+ * is evicted. All functions must be called with the coremap lock held.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <addrspace.h>
+#include <vm.h>
+
+#define PCACHE_BUCKETS 64
+
+static int pcache[PCACHE_BUCKETS];
+static int pcache_ready;
+
+static unsigned pcache_hash(struct vnode *vn, vaddr_t va){
+	return (((u_int32_t)vn >> 4) ^ (va >> PT_L2_SHIFT)) % PCACHE_BUCKETS;
+}
+
+static void pcache_init(void){
+	int i;
+	for(i = 0; i < PCACHE_BUCKETS; i++)
+		pcache[i] = NO_PAGE;
+	pcache_ready = 1;
+}
+
+/*
+	returns the coremap index of the resident page va of executable vn, or NO_PAGE
+*/
+int pcache_lookup(struct vnode *vn, vaddr_t va){
+	int i;
+
+	assert(cmap_lock_held());
+	if(!pcache_ready)
+		return NO_PAGE;
+
+	for(i = pcache[pcache_hash(vn, va)]; i != NO_PAGE; i = cmap[i].pc_next){
+		if(cmap[i].pc_vn == vn && cmap[i].va == va)
+			return i;
+	}
+	return NO_PAGE;
+}
+
+/*
+	enters the frame at coremap index, which holds page cmap[index].va of vn. If somebody got
+	the same page in first the frame just stays private
+*/
+void pcache_insert(unsigned long index, struct vnode *vn){
+	unsigned h;
+
+	assert(cmap_lock_held());
+	if(!pcache_ready)
+		pcache_init();
+	if(pcache_lookup(vn, cmap[index].va) != NO_PAGE)
+		return;
+
+	h = pcache_hash(vn, cmap[index].va);
+	cmap[index].pc_vn = vn;
+	cmap[index].pc_next = pcache[h];
+	pcache[h] = index;
+}
+
+/*
+	takes the frame at coremap index out of the cache, if it is in it
+*/
+void pcache_remove(unsigned long index){
+	int *ip;
+
+	assert(cmap_lock_held());
+	if(cmap[index].pc_vn == NULL)
+		return;
+
+	for(ip = &pcache[pcache_hash(cmap[index].pc_vn, cmap[index].va)]; *ip != NO_PAGE; ip = &cmap[*ip].pc_next){
+		if((unsigned long)*ip == index){
+			*ip = cmap[index].pc_next;
+			break;
+		}
+	}
+	cmap[index].pc_vn = NULL;
+	cmap[index].pc_next = NO_PAGE;
+}
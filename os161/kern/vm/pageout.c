@@ -0,0 +1,89 @@
+/*
+ * Pageout daemon.
+ *
+ * Without it, once RAM fills up every fault evicts a page itself and
+ * waits for the swap write before it can go on. Instead, a kernel
+ * thread keeps some memory free ahead of time: when an allocation
+ * leaves fewer than pageout_low free pages, the daemon is woken and
+ * pages out victims chosen by the replacement policy until
+ * pageout_high pages are free again.
+ *
+ * (Free pages are zeroed ahead of time too, but only while the cpu
+ * has nothing else to do: see vm_idle_zero.)
+ *
+ * Faults still evict synchronously when the daemon falls behind and
+ * memory runs out completely.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <thread.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <machine/spl.h>
+
+static unsigned long pageout_low;
+static unsigned long pageout_high;
+static int pageout_sleeping;
+
+static int pageout_needed(void){
+	return pages_avail < pageout_low;
+}
+
+/*
+	called with the coremap lock held whenever free pages are handed out
+*/
+void pageout_wakeup(void){
+	int spl = splhigh();
+
+	if(pageout_sleeping && pageout_needed()){
+		pageout_sleeping = 0;
+		thread_wakeup(&pageout_sleeping);
+	}
+	splx(spl);
+}
+
+static void pageout_thread(void *unused, unsigned long junk){
+	int spl;
+
+	(void)unused;
+	(void)junk;
+
+	spl = splhigh();
+	while(1){
+		while(!pageout_needed()){
+			pageout_sleeping = 1;
+			thread_sleep(&pageout_sleeping);
+		}
+
+		while(pages_avail < pageout_high){
+			if(!vm_pageout_one())
+				break;
+			//let the faults that woke us run between writes
+			splx(spl);
+			spl = splhigh();
+		}
+
+		//nothing more we can do until somebody allocates again
+		pageout_sleeping = 1;
+		thread_sleep(&pageout_sleeping);
+	}
+}
+
+/*
+	called from boot() once the vm system is up
+*/
+void pageout_bootstrap(void){
+	int result;
+
+	pageout_low = pages_avail / 32;
+	if(pageout_low < 4)
+		pageout_low = 4;
+	pageout_high = 2 * pageout_low;
+
+	result = thread_fork("pageout", NULL, 0, pageout_thread, NULL);
+	if(result){
+		panic("pageout_bootstrap: thread_fork failed: %s\n", strerror(result));
+	}
+}
@@ -0,0 +1,198 @@
+/*
+ * Page replacement policies.
+ *
+ * The VM system asks find_victim() for a user page to evict when RAM
+ * is full (and gets page_count if nothing at all can be evicted). Which page gets picked is up to the policy currently
+ * selected with vm_set_policy() (menu command "vmp"), so the
+ * policies can be compared on the same workload without rebuilding:
+ *
+ *    fifo    - evict the page that was allocated the longest time ago
+ *              (the original timestamp scan).
+ *    clock   - second chance. A hand sweeps the coremap; pages that
+ *              were referenced since the hand last passed get their
+ *              bit cleared and survive, the first unreferenced page
+ *              is evicted.
+ *    wsclock - clock, but a page is only evicted once it has been
+ *              unreferenced for longer than the working set window,
+ *              and clean pages are preferred over dirty ones.
+ *
+ * Reference bits are kept in software: vm_fault sets cmap[].referenced
+ * whenever it loads a translation into the TLB. When the hand clears
+ * the bit it also drops the page's TLB entry, so the next access
+ * faults (cheaply, the page is resident) and sets the bit again.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <clock.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <machine/spl.h>
+
+/* pages not referenced for this many faults are outside the working set */
+#define WSCLOCK_TAU 64
+
+static unsigned long hand;
+static struct page_policy *cur_policy;
+
+unsigned long vm_vtime;
+unsigned long vm_evictions;
+
+/*
+	only user pages that belong to an address space, and that nobody has pinned, can be evicted
+*/
+int page_evictable(unsigned long index){
+	if(cmap[index].busy) return 0;
+	if(cmap[index].state == fixed) return 0;
+	if(cmap[index].state == freed) return 0;
+	if(cmap[index].p_state == kernel) return 0;
+	if(cmap[index].as == NULL) return 0;
+	return 1;
+}
+
+static void advance_hand(void){
+	hand++;
+	if(hand >= page_count)
+		hand = 0;
+}
+
+static unsigned long fifo_victim(void){
+	unsigned long i;
+	unsigned long ret = page_count;
+
+	time_t min_s;
+	u_int32_t min_ns;
+
+	gettime(&min_s, &min_ns);
+
+	for(i = 0; i < page_count; i++){
+		//the pageout daemon runs while some frames are still free, so skip them like any other unevictable page
+		if(!page_evictable(i)) continue;
+
+		if(cmap[i].s < min_s){
+			min_s = cmap[i].s;
+			min_ns = cmap[i].ns;
+			ret = i;
+		}
+		else if(cmap[i].s == min_s){
+			if(cmap[i].ns < min_ns){
+				min_s = cmap[i].s;
+				min_ns = cmap[i].ns;
+				ret = i;
+			}
+		}
+	}
+	return ret;
+}
+
+static unsigned long clock_victim(void){
+	unsigned long steps;
+	unsigned long ret;
+
+	//two full sweeps are always enough: the first clears every reference bit
+	for(steps = 0; steps < 2*page_count; steps++){
+		if(page_evictable(hand)){
+			if(cmap[hand].referenced){
+				cmap[hand].referenced = 0;
+				tlb_invalidate_pa(cmap[hand].pa);
+			}
+			else{
+				ret = hand;
+				advance_hand();
+				return ret;
+			}
+		}
+		advance_hand();
+	}
+	//everything is pinned or belongs to the kernel
+	return page_count;
+}
+
+static unsigned long wsclock_victim(void){
+	unsigned long steps;
+	unsigned long ret;
+	unsigned long old_dirty = page_count;	//first old page that would need a write
+	unsigned long any = page_count;			//first unreferenced page
+
+	for(steps = 0; steps < page_count; steps++){
+		if(page_evictable(hand)){
+			if(cmap[hand].referenced){
+				cmap[hand].referenced = 0;
+				cmap[hand].last_used = vm_vtime;
+				tlb_invalidate_pa(cmap[hand].pa);
+			}
+			else{
+				if(any == page_count)
+					any = hand;
+				if(vm_vtime - cmap[hand].last_used > WSCLOCK_TAU){
+					if(cmap[hand].state == clean){
+						ret = hand;
+						advance_hand();
+						return ret;
+					}
+					if(old_dirty == page_count)
+						old_dirty = hand;
+				}
+			}
+		}
+		advance_hand();
+	}
+
+	//nothing clean outside the working set: fall back to an old dirty page,
+	//then to any unreferenced page, and finally behave like plain clock
+	if(old_dirty != page_count)
+		return old_dirty;
+	if(any != page_count)
+		return any;
+	return clock_victim();
+}
+
+static struct page_policy policies[] = {
+	{ "fifo",	fifo_victim },
+	{ "clock",	clock_victim },
+	{ "wsclock",	wsclock_victim },
+	{ NULL, NULL }
+};
+
+/*
+	pick a user page to evict using the current policy. Must be called with the coremap lock held.
+	Returns page_count if there is no page that can be evicted
+*/
+unsigned long find_victim(void){
+	unsigned long index;
+
+	assert(cmap_lock_held());
+	if(cur_policy == NULL)
+		cur_policy = &policies[1];
+
+	index = cur_policy->pp_victim();
+	if(index == page_count)
+		return page_count;
+	assert(page_evictable(index));
+	vm_evictions++;
+	return index;
+}
+
+int vm_set_policy(const char *name){
+	int i, spl;
+
+	for(i = 0; policies[i].pp_name != NULL; i++){
+		if(!strcmp(policies[i].pp_name, name)){
+			spl = splhigh();
+			cur_policy = &policies[i];
+			vm_evictions = 0;
+			vm_swap_writes = 0;
+			vm_swap_ios = 0;
+			splx(spl);
+			return 0;
+		}
+	}
+	return EINVAL;
+}
+
+const char *vm_get_policy(void){
+	if(cur_policy == NULL)
+		cur_policy = &policies[1];
+	return cur_policy->pp_name;
+}
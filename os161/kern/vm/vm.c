@@ -13,13 +13,14 @@
 #include <vfs.h>
 #include <vnode.h>
 #include <kern/stat.h>
+#include <kern/vmstat.h>
 #include <uio.h>
 #include <clock.h>
+#include <bitmap.h>
 
 int vm_bootstrap_done = 0;
 
 struct cmap_entry *cmap;
-struct lock* access_cmap;
 unsigned long cmap_size;
 unsigned long page_count;
 paddr_t cmap_start_physaddr;
@@ -27,8 +28,142 @@ paddr_t cmap_start_physaddr;
 struct vnode *swap_file;
 struct smap_entry *smap;
 unsigned long smap_page_count;
+struct bitmap *smap_freemap;	//one bit per swap slot, set while the slot is occupied
+
+int kernel_pages;
+int user_pages;		//resident user frames, i.e. what there is to page out
+unsigned long vm_swap_writes;	//evictions that had to write the page to swap
+unsigned long vm_swap_ios;		//read and write requests sent to the swap disk
+unsigned long vm_swap_reads;	//pages read back from swap
+unsigned long vm_minflt;		//faults resolved without any I/O
+unsigned long vm_majflt;		//faults that had to read the page from swap or the executable
+
+// clustered swap I/O: up to SWAP_CLUSTER pages that sit in consecutive swap slots are read or
+// written with a single request through swap_cluster_buf. While a clustered write is in
+// flight, [cluster_wslot, cluster_wslot + cluster_wn) is only up to date in the buffer
+vaddr_t swap_cluster_buf;
+static int cluster_busy;
+static int cluster_wslot = NO_SLOT;
+static int cluster_wn;
+static int smap_hint;		//where swap_alloc_run starts looking
+
+#define CLUSTER_WRITING(slot) (cluster_wslot != NO_SLOT && (slot) >= cluster_wslot && (slot) < cluster_wslot + cluster_wn)
+
+// free page index, kept next to the coremap:
+//	cmap_freelist - doubly linked list (through cmap[].next_free/prev_free) of freed pages,
+//					so single page allocations just pop the head
+//	cmap_zerolist - same, for freed pages already zeroed while the cpu was idle (vm_idle_zero).
+//					demand_page takes these first so it doesn't have to clear the page itself
+//	cmap_freemap  - one bit per coremap entry, set while the page is freed. Multi-page runs are
+//					found a word (32 pages) at a time instead of one entry at a time
+#define FREEMAP_BITS 32
+
+int cmap_freelist;
+int cmap_zerolist;
+unsigned long cmap_zeroed_pages;
+static unsigned long zero_target;	//how many zeroed pages vm_idle_zero keeps around
+u_int32_t *cmap_freemap;
+unsigned long cmap_freemap_words;
+
+static unsigned long make_room(void);
+static int mmap_writeback(unsigned long index, struct region_array *region);
 
-int kernel_pages, user_pages;
+/*
+	the coremap lock. Whoever holds it owns the coremap, the swap map, the free lists and the
+	resident/on disk state of every pte; interrupts stay on. It is a sleep lock of our own
+	rather than a struct lock because the VM code allocates from the kernel heap as it goes,
+	which gets back here through alloc_kpages, so the holder may take it again, and because
+	kmalloc needs it before lock_create could be called.
+
+	Nobody holds it across disk I/O: cmap_io_begin lets it go entirely and cmap_io_end takes
+	it back, so other threads can fault on resident pages while one waits for the disk.
+	Whatever the sleeping thread is in the middle of is pinned meanwhile: frames being read
+	into or copied from are busy (page_evictable skips them), and swap slots being written
+	are marked in smap[].writing (they are not reused, and load_page waits for them).
+	Anything else may have changed by the time cmap_io_end returns
+*/
+static struct thread *cmap_holder;
+static int cmap_depth;
+
+void cmap_lock(void){
+	int spl;
+
+	assert(in_interrupt == 0);
+	spl = splhigh();
+	if(cmap_holder != curthread){
+		while(cmap_holder != NULL)
+			thread_sleep(&cmap_holder);
+		cmap_holder = curthread;
+	}
+	cmap_depth++;
+	splx(spl);
+}
+
+void cmap_unlock(void){
+	int spl = splhigh();
+
+	assert(cmap_holder == curthread && cmap_depth > 0);
+	cmap_depth--;
+	if(cmap_depth == 0){
+		cmap_holder = NULL;
+		thread_wakeup(&cmap_holder);
+	}
+	splx(spl);
+}
+
+int cmap_lock_held(void){
+	return cmap_holder == curthread;
+}
+
+/*
+	gives up the coremap lock, however many times we hold it, before sleeping on the disk.
+	Returns what cmap_io_end needs to take it back
+*/
+static int cmap_io_begin(void){
+	int spl = splhigh();
+	int depth = cmap_depth;
+
+	assert(cmap_holder == curthread && depth > 0);
+	cmap_depth = 0;
+	cmap_holder = NULL;
+	thread_wakeup(&cmap_holder);
+	splx(spl);
+	return depth;
+}
+
+static void cmap_io_end(int depth){
+	int spl = splhigh();
+
+	while(cmap_holder != NULL)
+		thread_sleep(&cmap_holder);
+	cmap_holder = curthread;
+	cmap_depth = depth;
+	splx(spl);
+}
+
+/*
+	sleeps on addr without the coremap lock, and takes it back on wakeup. Whatever we are
+	waiting for is changed, and addr woken, by a holder of the lock, so the wakeup can't be missed
+*/
+static void cmap_sleep(const void *addr){
+	int spl = splhigh();
+	int depth = cmap_io_begin();
+
+	thread_sleep(addr);
+	cmap_io_end(depth);
+	splx(spl);
+}
+
+/*
+	drops a pin on the frame at coremap index. page_release waits for the last one before it
+	frees a frame somebody is writing back (see page_out)
+*/
+static void page_unbusy(unsigned long index){
+	assert(cmap[index].busy > 0);
+	cmap[index].busy--;
+	if(cmap[index].busy == 0)
+		thread_wakeup(&cmap[index]);
+}
 
 // --------------------- in RAM---------------------------
 // [smap_start_physaddr, smap_start_physaddr + smap_size] --> smap
@@ -39,6 +174,95 @@ int kernel_pages, user_pages;
 // [0			 , cmapsize) --> fixed  - cmap
 // [cmapsize, last_physaddr] --> freed
 
+/*
+	free list / free bitmap maintenance. Call with the coremap lock held
+*/
+static void list_add(int *head, unsigned long index){
+	cmap[index].prev_free = NO_PAGE;
+	cmap[index].next_free = *head;
+	if(*head != NO_PAGE)
+		cmap[*head].prev_free = index;
+	*head = index;
+
+	cmap_freemap[index / FREEMAP_BITS] |= ((u_int32_t)1 << (index % FREEMAP_BITS));
+}
+
+static void freelist_add(unsigned long index){
+	cmap[index].zeroed = 0;
+	list_add(&cmap_freelist, index);
+}
+
+static void zerolist_add(unsigned long index){
+	cmap[index].zeroed = 1;
+	cmap_zeroed_pages++;
+	list_add(&cmap_zerolist, index);
+}
+
+/*
+	takes a freed page off whichever list it is on. cmap[].zeroed is left alone, so the caller
+	can still tell whether the page it got is clear
+*/
+static void freelist_remove(unsigned long index){
+	int *head = cmap[index].zeroed ? &cmap_zerolist : &cmap_freelist;
+
+	assert(cmap_freemap[index / FREEMAP_BITS] & ((u_int32_t)1 << (index % FREEMAP_BITS)));
+
+	if(cmap[index].zeroed)
+		cmap_zeroed_pages--;
+	if(cmap[index].prev_free != NO_PAGE)
+		cmap[cmap[index].prev_free].next_free = cmap[index].next_free;
+	else
+		*head = cmap[index].next_free;
+	if(cmap[index].next_free != NO_PAGE)
+		cmap[cmap[index].next_free].prev_free = cmap[index].prev_free;
+	cmap[index].next_free = NO_PAGE;
+	cmap[index].prev_free = NO_PAGE;
+
+	cmap_freemap[index / FREEMAP_BITS] &= ~((u_int32_t)1 << (index % FREEMAP_BITS));
+}
+
+/*
+	returns the coremap index of the first page of a run of npages freed pages, or page_count
+	if there is none. Fully allocated words of the bitmap are skipped 32 pages at a time
+*/
+static unsigned long find_free_run(unsigned long npages){
+	unsigned long w, bit, i, nfound = 0;
+
+	//zeroed pages are kept for demand_page, anybody else only gets them when nothing else is left
+	if(npages == 1){
+		if(cmap_freelist != NO_PAGE)
+			return cmap_freelist;
+		return (cmap_zerolist == NO_PAGE) ? page_count : (unsigned long)cmap_zerolist;
+	}
+
+	for(w = 0; w < cmap_freemap_words; w++){
+		if(cmap_freemap[w] == 0){
+			nfound = 0;
+			continue;
+		}
+		if(cmap_freemap[w] == 0xffffffff && (w+1)*FREEMAP_BITS <= page_count){
+			nfound += FREEMAP_BITS;
+			if(nfound >= npages)
+				return (w+1)*FREEMAP_BITS - nfound;
+			continue;
+		}
+		for(bit = 0; bit < FREEMAP_BITS; bit++){
+			i = w*FREEMAP_BITS + bit;
+			if(i >= page_count)
+				break;
+			if(cmap_freemap[w] & ((u_int32_t)1 << bit)){
+				nfound++;
+				if(nfound == npages)
+					return i + 1 - npages;
+			}
+			else{
+				nfound = 0;
+			}
+		}
+	}
+	return page_count;
+}
+
 void vm_bootstrap(void)
 {
 //	unsigned long i;
@@ -61,6 +285,8 @@ void vm_bootstrap(void)
 	VOP_STAT(swap_file, &swap_status);
 
 	smap_page_count = swap_status.st_size / PAGE_SIZE;
+	if(smap_page_count > SWAP_MAX_SLOTS)
+		smap_page_count = SWAP_MAX_SLOTS;	//a pte can only name this many slots
 	smap_size = smap_page_count * sizeof(struct smap_entry);
 	smap_size = DIVROUNDUP(smap_size, PAGE_SIZE);
 	smap_start_physaddr = ram_stealmem(smap_size);
@@ -69,24 +295,59 @@ void vm_bootstrap(void)
 	for(i = 0; i < smap_page_count; i++){
 		smap[i].disk_pa = (i*PAGE_SIZE);
 		smap[i].state = empty;
-		smap[i].as = NULL;
-		smap[i].va = 0;
+		smap[i].refcount = 0;
+		smap[i].writing = 0;
+		smap[i].bad = 0;
 	}
 
+	smap_freemap = bitmap_create(smap_page_count);
+	assert(smap_freemap != NULL);
+
 	smap_pages_avail = smap_page_count;
 
+	swap_cluster_buf = PADDR_TO_KVADDR(ram_stealmem(SWAP_CLUSTER));
+
 	//--------------------------------------- coremap ----------------------------------------------------
 	paddr_t first_physaddr, last_physaddr;
 
 	ram_getsize(&first_physaddr, &last_physaddr);	
 
 	page_count = (last_physaddr - first_physaddr) / PAGE_SIZE; 			//number of pages the physical memory can store
+	cmap_freemap_words = DIVROUNDUP(page_count, FREEMAP_BITS);
 	cmap_size = page_count * sizeof(struct cmap_entry);					//need to allocate page_count entries in the cmap in order to keep track of each entry
+	cmap_size += cmap_freemap_words * sizeof(u_int32_t);				//the free page bitmap lives right after the cmap entries
 	cmap_size = DIVROUNDUP(cmap_size, PAGE_SIZE);						//round the cmap size to the nearest page
 	cmap_start_physaddr = ram_stealmem(cmap_size);						//pass number of pages we want to "steal". stolen pages won't be freed
 	cmap = (struct cmap_entry*) PADDR_TO_KVADDR(cmap_start_physaddr);	//allocate the cmap in the first part of the physical memory
+	cmap_freemap = (u_int32_t *) &cmap[page_count];
 
-	for(i = 0; i < page_count; i++){
+	for(i = 0; i < cmap_freemap_words; i++){
+		cmap_freemap[i] = 0;
+	}
+	cmap_freelist = NO_PAGE;
+	cmap_zerolist = NO_PAGE;
+	cmap_zeroed_pages = 0;
+
+	//walk backwards so the free list ends up in ascending address order
+	for(i = page_count; i-- > 0; ){
+		cmap[i].pa = cmap_start_physaddr + (i*PAGE_SIZE);
+		cmap[i].as = NULL;
+		cmap[i].va = 0;
+		cmap[i].s = 0;
+		cmap[i].ns = 0;
+		cmap[i].referenced = 0;
+		cmap[i].last_used = 0;
+		cmap[i].next_free = NO_PAGE;
+		cmap[i].prev_free = NO_PAGE;
+		cmap[i].refcount = 0;
+		cmap[i].sharers = NULL;
+		cmap[i].swap_slot = NO_SLOT;
+		cmap[i].busy = 0;
+		cmap[i].zeroed = 0;
+		cmap[i].pc_vn = NULL;
+		cmap[i].pc_next = NO_PAGE;
+		cmap[i].pageref = NULL;
+		cmap[i].kmsite = 0;
 		if(i < cmap_size){
 			cmap[i].state = fixed;
 		}
@@ -94,28 +355,58 @@ void vm_bootstrap(void)
 			cmap[i].state = freed;
 			cmap[i].num_pages = -1;
 			cmap[i].first_page = 0;
+			freelist_add(i);
 		}
-		cmap[i].pa = cmap_start_physaddr + (i*PAGE_SIZE);
-		cmap[i].as = NULL;
-		cmap[i].s = 0;
-		cmap[i].ns = 0;
 	}
 
 	pages_avail = page_count - cmap_size;
+	zero_target = pages_avail / 16;
+	if(zero_target < 8)
+		zero_target = 8;
 
-	//access_cmap = lock_create("access_cmap");
+	//anonymous memory can live in swap or in the RAM the kernel heap doesn't need
+	vm_commit_limit = smap_page_count + pages_avail - pages_avail / COMMIT_KERNEL_SHARE;
 
 	ram_reset();
 
 	vm_bootstrap_done = 1;
+
+	as_bootstrap();
 }
 
-void free_all_pages(struct addrspace *as){
-	unsigned long i;
-	for(i = 0; i < page_count; i++){
-		if(cmap[i].as == as)
-			free_kpages(PADDR_TO_KVADDR(cmap[i].pa));
+/*
+	hands the npages freed pages starting at coremap index i to as. Call with the coremap lock held
+*/
+static void claim_run(unsigned long i, unsigned long npages, page_state_t pstate, struct addrspace *as){
+	unsigned long j;
+	time_t s;
+	u_int32_t ns;
+
+	gettime(&s, &ns);
+	for(j = i; j < i + npages; j++){
+		assert(cmap[j].state == freed);
+		freelist_remove(j);
+		cmap[j].as = as;
+		cmap[j].state = dirty;
+		cmap[j].num_pages = npages;
+		cmap[j].p_state = pstate;
+		cmap[j].first_page = 0;
+		cmap[j].s = s;
+		cmap[j].ns = ns;
+		cmap[j].referenced = 1;
+		cmap[j].last_used = vm_vtime;
+		cmap[j].va = 0;
+		cmap[j].refcount = 0;
+		cmap[j].sharers = NULL;
+		cmap[j].swap_slot = NO_SLOT;
+		cmap[j].busy = 0;
+		cmap[j].pc_vn = NULL;
+		cmap[j].pc_next = NO_PAGE;
 	}
+	cmap[i].first_page = 1;		//first page in block
+	pages_avail -= npages;
+
+	pageout_wakeup();
 }
 
 /*
@@ -134,58 +425,19 @@ paddr_t getppages(unsigned long npages, page_state_t pstate, struct addrspace *a
 	}
 	else{
 		//just allocate npages from the pages marked as free in the coremap
-		//lock_acquire(access_cmap);
-		int spl = splhigh();
+		cmap_lock();
 		//kprintf("pages avail = %d\n", pages_avail);
 	//	assert(npages <= pages_avail);
-		//search the coremap for npages free pages
+		//pick npages free pages off the free list / free bitmap
 		if(npages <= pages_avail){
-			unsigned long i, j, k, nfound = 0;
-			for(i = 0; i < page_count; i++){
-				if (cmap[i].state == freed) {
-					nfound++;
-
-					if (nfound == npages){
-						//kprintf("PP:kernel? = %d\n", (pstate==kernel));
-						//kprintf("PP:cur_as = %x\nPP:setting as = %x\n",curthread->t_vmspace, as);
-						for(j = i, k=0; j > i-npages; j--, k++){
-							cmap[j].as = as;
-							cmap[j].state = dirty;
-							cmap[j].num_pages = npages;
-							cmap[j].p_state = pstate;
-							time_t s;
-							u_int32_t ns;
-							
-							gettime(&s, &ns);
-							cmap[j].s = s;
-							cmap[j].ns = ns;
-
-							//if(cmap[j].as == 0x80032f00)
-									//kprintf("as = %x writing to page #%d\n", cmap[j].as, i);
-							if(k==npages-1){ //first page in block
-								cmap[j].first_page = 1;
-								ret_addr = cmap[j].pa;
-								pages_avail -= npages;
-								/*
-								if(pstate == kernel){
-									kprintf("K: updated cmap ind = %d\n", i);
-								}
-								else{
-									kprintf("U: updated cmap ind = %d\n", i);	
-								}*/
-								//kprintf("writing to page index = %d\n", i);
-							}
-						}
-						break;
-					}
-				}
-				else{
-					nfound = 0;
-				}
-
+			unsigned long i;
+			i = find_free_run(npages);
+			if(i < page_count){
+				claim_run(i, npages, pstate, as);
+				ret_addr = cmap[i].pa;
 			}
 		}
-		splx(spl);
+		cmap_unlock();
 	}
 	//if(ret_addr == 237568)
 	//	kprintf("hereeeeeeeeeeeeeeeeee! addr = %x\n", as);
@@ -203,27 +455,17 @@ alloc_kpages(int npages)
 
 	if (pa == 0) {
 		assert(vm_bootstrap_done == 1);
-		int spl = splhigh();
+		cmap_lock();
 		//kprintf("KERNEL: demanding a page\n");
-		// Make space on RAM
-		unsigned long lru_index = find_lru();
-		pa = cmap[lru_index].pa;
-		unsigned long offset;
-		int evict = 1;
-		if(cmap[lru_index].state == clean) evict = EVICT_CLEAN;
-		else evict = EVICT_DIRTY;
-		//kprintf("K: %x evicting page %d\n", curthread->t_vmspace, pa);
-		struct pte *evicted_pte = update_pte(lru_index);
-
-		//get space on disk must be called before updating the cmap entry. that way
-		//we look for the offset where the page to be evicted (using the old offset)
-		//was stored on disk (if it were stored on disk before) or we just get a new offset.
-		if(evict == 1)
-			offset = get_space_on_disk(lru_index, evicted_pte->va, SWAPOUT);
-		update_cmap(lru_index, NULL, dirty, kernel);
-		if(evict == 1)
-			swap_out( offset, PADDR_TO_KVADDR(pa));
-		splx(spl);
+		// Make space on RAM. If nothing can go, kmalloc fails and its caller sees ENOMEM
+		unsigned long index = npages == 1 ? make_room() : page_count;
+		if(index == page_count){
+			cmap_unlock();
+			return 0;
+		}
+		update_cmap(index, NULL, dirty, kernel);
+		pa = cmap[index].pa;
+		cmap_unlock();
 	}
 	return PADDR_TO_KVADDR(pa);
 }
@@ -244,14 +486,14 @@ alloc_upages(int npages, struct addrspace *as)
 void 
 free_kpages(vaddr_t addr)
 {
-	int spl = splhigh();
-	//lock_acquire(access_cmap);
+	cmap_lock();
 	paddr_t phy_addr = KVADDR_TO_PADDR(addr);
 	unsigned long i, j;
-	for(i = 0; i < page_count; i++) {
-		if (cmap[i].pa == phy_addr)
-			break;
-	}
+
+	assert(phy_addr >= cmap_start_physaddr);
+	i = PADDR_TO_CMAP_INDEX(phy_addr);
+	assert(i < page_count);
+	assert(cmap[i].pa == phy_addr);
 
 	if (cmap[i].first_page == 1){
 		unsigned long length = cmap[i].num_pages;
@@ -260,333 +502,1316 @@ free_kpages(vaddr_t addr)
 			cmap[i+j].p_state = user;
 			cmap[i+j].num_pages = -1;
 			cmap[i+j].as = NULL;
+			cmap[i+j].refcount = 0;
+			assert(cmap[i+j].sharers == NULL);
+			freelist_add(i+j);
 		}
 		cmap[i].first_page = 0;
 		pages_avail += length;
 	}
-	splx(spl);
+	cmap_unlock();
 }
 
-unsigned long find_lru(){
-	unsigned long i;
-	unsigned long ret = page_count;
+/*
+	swap slots. A slot is named by its index in smap (its disk offset is index*PAGE_SIZE) and is
+	reference counted: every pte that has its page in the slot, and every resident frame whose
+	copy on disk is still in the slot (cmap[].swap_slot), holds one reference. Slots shared by a
+	fork are therefore never copied, and finding a page's slot never needs a search. Free slots
+	are found through smap_freemap. Call with the coremap lock held. Returns NO_SLOT if swap is full
+*/
+int swap_alloc(void){
+	u_int32_t i;
+	if(bitmap_alloc(smap_freemap, &i)){
+		return NO_SLOT;
+	}
+	assert(smap[i].state == empty);
+	smap[i].state = occupied;
+	smap[i].refcount = 1;
+	smap_pages_avail--;
+	return i;
+}
 
-	time_t min_s;
-	u_int32_t min_ns;
-	
-	gettime(&min_s, &min_ns);
-
-	for(i = 0; i < page_count; i++){
-		//TODO: shouldn't this assert be true all the time???
-		assert(cmap[i].state != freed);	//there cannot be any freed pages at this point. if there are freed pages, a page would have been allocated and no need to swap out
-		if(cmap[i].state == fixed) continue;
-		if(cmap[i].p_state == kernel) continue;
-		if(cmap[i].as == NULL)continue;
-
-		if(cmap[i].s < min_s){
-			min_s = cmap[i].s;
-			min_ns = cmap[i].ns;
-			ret = i;
-		}
-		else if(cmap[i].s == min_s){
-			if(cmap[i].ns < min_ns){
-				min_s = cmap[i].s;
-				min_ns = cmap[i].ns;
-				ret = i;
-			}
-		}
+void swap_ref(int slot){
+	assert(slot >= 0 && (unsigned long)slot < smap_page_count);
+	assert(smap[slot].state == occupied);
+	smap[slot].refcount++;
+}
+
+static void swap_free(int slot){
+	if(smap[slot].bad)
+		return;		//stays allocated for good
+	smap[slot].state = empty;
+	bitmap_unmark(smap_freemap, slot);
+	smap_pages_avail++;
+}
+
+void swap_unref(int slot){
+	assert(slot >= 0 && (unsigned long)slot < smap_page_count);
+	assert(smap[slot].state == occupied && smap[slot].refcount > 0);
+	smap[slot].refcount--;
+	if(smap[slot].refcount == 0 && !smap[slot].writing)
+		swap_free(slot);
+}
+
+/*
+	a slot whose page is on its way to the disk stays allocated until the write is done, even
+	if its last reference goes meanwhile: a write by its next owner could land before ours.
+	Anyone who wants to read it waits for the write with swap_wait
+*/
+static void swap_write_begin(int slot, int n){
+	int k;
+
+	for(k = 0; k < n; k++){
+		assert(!smap[slot + k].writing);
+		smap[slot + k].writing = 1;
 	}
-	assert(ret < page_count);
-	//kprintf("entry #%d is the lru\n", ret);
-	return ret;
 }
 
-unsigned long get_space_on_disk(unsigned long index, vaddr_t faultaddress, swap_type_t swap_type){
-	struct addrspace *as = cmap[index].as;
-	unsigned long i;
+static void swap_write_end(int slot, int n){
+	int k;
 
-	faultaddress = (faultaddress & PAGE_FRAME);
+	for(k = 0; k < n; k++){
+		smap[slot + k].writing = 0;
+		if(smap[slot + k].refcount == 0)
+			swap_free(slot + k);
+		thread_wakeup(&smap[slot + k]);
+	}
+}
 
-	for(i = 0; i < smap_page_count; i++){
-		if((smap[i].as == as) && smap[i].va == faultaddress){
-			//kprintf("loading (%x, %d) from offset %u\n", as, faultaddress, (i*PAGE_SIZE));
-			//if we find an old entry on disk. It could be either a swap_in or a swap_out operation
-			//swap_in: we're loading a page from disk that we had stored previously
-			//swap_out: we are re-evicting a page that used to be stored on disk before
-			break;
+static void swap_wait(int slot){
+	while(smap[slot].writing)
+		cmap_sleep(&smap[slot]);
+}
+
+/*
+	the write of the n slots from slot on failed. The pages are gone, so whoever faults on them
+	gets EIO (see load_page) and is killed, rather than the whole system
+*/
+static void swap_bad(int slot, int n, int err){
+	int k;
+
+	kprintf("swap: write of %d page(s) at slot %d failed: %s\n", n, slot, strerror(err));
+	for(k = 0; k < n; k++)
+		smap[slot + k].bad = 1;
+}
+
+/*
+	allocates n free slots in a row, or returns NO_SLOT if there is no such run. Call with the
+	coremap lock held
+*/
+static int swap_alloc_run(int n){
+	unsigned long i, start, tried;
+	int run = 0;
+
+	start = (unsigned long)smap_hint < smap_page_count ? (unsigned long)smap_hint : 0;
+	for(tried = 0, i = start; tried < smap_page_count; tried++, i++){
+		if(i == smap_page_count){
+			//runs don't wrap around the end of the disk
+			i = 0;
+			run = 0;
 		}
-		if(smap[i].state == empty){
-			//kprintf("writing (%x, %d) to offset %u\n", as, faultaddress, (i*PAGE_SIZE));
-			//if we are getting a new offset, it must be a swap_out operation
-			//if it were a swap_in operation, we should have found it earlier on disk!
-			assert(swap_type == SWAPOUT);
-			assert( i >= (smap_page_count - smap_pages_avail));
-			smap_pages_avail--;
-			break;
+		if(smap[i].state != empty){
+			run = 0;
+			continue;
+		}
+		if(++run == n){
+			unsigned long first = i + 1 - n;
+			for(i = first; i < first + n; i++){
+				bitmap_mark(smap_freemap, i);
+				smap[i].state = occupied;
+				smap[i].refcount = 1;
+			}
+			smap_pages_avail -= n;
+			smap_hint = first + n;
+			return first;
 		}
 	}
-	assert(i < smap_page_count);
-
-	smap[i].state = occupied;
-	smap[i].as = as;
-	smap[i].va = faultaddress;
+	return NO_SLOT;
+}
 
-	return (i*PAGE_SIZE);
+/*
+	one request for n pages between swap_cluster_buf and the slots starting at slot. Returns 0
+	or the error from the disk
+*/
+static int swap_cluster_io(int slot, int n, enum uio_rw rw){
+	struct uio uio_swap;
+	int result, depth;
+
+	mk_kuio(&uio_swap, (void *)swap_cluster_buf, n*PAGE_SIZE, slot*PAGE_SIZE, rw);
+	vm_swap_ios++;
+	if(rw == UIO_WRITE)
+		swap_write_begin(slot, n);
+
+	depth = cmap_io_begin();
+	if(rw == UIO_READ)
+		result = VOP_READ(swap_file, &uio_swap);
+	else
+		result = VOP_WRITE(swap_file, &uio_swap);
+	cmap_io_end(depth);
+
+	if(rw == UIO_WRITE){
+		if(result)
+			swap_bad(slot, n, result);
+		swap_write_end(slot, n);
+	}
+	return result;
 }
 
 /*
-	writes the old page content to disk, invalidates the tlb entry
+	writes the old page content to disk, invalidates the tlb entry. The coremap lock is let go
+	during the write. Returns 0 or the error from the disk, in which case the slot is bad
 */
-void swap_out(unsigned long offset,vaddr_t va){
-	int spl = splhigh();
+int swap_out(unsigned long offset,vaddr_t va){
 	struct uio uio_swap;
-	
+	int depth;
+
+	//invalidate the evicted tlb entries first, so nobody writes the page while it goes out
+	tlb_invalidate_pa(KVADDR_TO_PADDR(va));
+
 	mk_kuio(&uio_swap,(void *)(va & PAGE_FRAME), PAGE_SIZE, offset, UIO_WRITE);
 
+	vm_swap_ios++;
+	swap_write_begin(offset / PAGE_SIZE, 1);
+
+	depth = cmap_io_begin();
 	int ret = VOP_WRITE(swap_file, &uio_swap);
-	if(ret){
-		panic("swap_out: couldn't write to disk");
-	}
-	//invalidate the evicted tlb entry
+	cmap_io_end(depth);
+
+	if(ret)
+		swap_bad(offset / PAGE_SIZE, 1, ret);
+	swap_write_end(offset / PAGE_SIZE, 1);
+	return ret;
+}
+
+void tlb_invalidate_pa(paddr_t pa){
 	u_int32_t ehi,elo,i;
-	paddr_t pa = KVADDR_TO_PADDR(va);
+	int spl = splhigh();
 
+	//whatever address space the entry belongs to
 	for (i = 0; i < NUM_TLB; i++) {
 
 		TLB_Read(&ehi, &elo, i);
 
-		if ((elo & PAGE_FRAME) == (pa & PAGE_FRAME))	{
+		if ((elo & TLBLO_VALID) && (elo & PAGE_FRAME) == (pa & PAGE_FRAME))	{
 			TLB_Write(TLBHI_INVALID(i), TLBLO_INVALID(), i);		
 		}
 	}
+	TLB_SetPID(cur_asid);
 	splx(spl);
-	return;
 }
 
 /*
-	writes the page at an a disk offset (offset)
+	drop the translation of va in as, if the TLB has one
 */
-void swap_in(unsigned long offset, vaddr_t va){
-	
-	int spl=splhigh();
-
-	struct uio uio_swap;
-	
-	mk_kuio(&uio_swap,(void *)(va & PAGE_FRAME), PAGE_SIZE, offset, UIO_READ);
-
-	int result=VOP_READ(swap_file, &uio_swap);
-	if(result) {
-		panic("VM: SWAP in Failed");
+void tlb_invalidate_va(struct addrspace *as, vaddr_t va){
+	int i, spl = splhigh();
+
+	if(as->asid_gen == asid_generation){
+		i = TLB_Probe((va & PAGE_FRAME) | (as->asid << TLBHI_PIDSHIFT), 0);
+		if(i >= 0)
+			TLB_Write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+		TLB_SetPID(cur_asid);
 	}
-
 	splx(spl);
 }
 
-
-struct pte * update_pte(unsigned long index){
+/*
+	drop every translation of as
+*/
+void tlb_invalidate_as(struct addrspace *as){
+	u_int32_t ehi,elo,i;
 	int spl = splhigh();
-	//kprintf("update_pte: the addrspace = %x\nupdate_pte: pa = %d\n", cmap[index].as, cmap[index].pa);
-	struct pte *old_entry = cmap[index].as->pages;
-	//kprintf("PTE:address space = %x\nPTE:cmap[lru].pa = %d\n", cmap[index].as, cmap[index].pa);
-	while(old_entry != NULL){
-		/*
-		if(old_entry == cmap[index].as->pages)
-			kprintf("--------------------------------pages----------------------------------\n");
-		else if(old_entry == cmap[index].as->stack)
-			kprintf("--------------------------------stack----------------------------------\n");
-		else if(old_entry == cmap[index].as->heap)
-			kprintf("--------------------------------heap----------------------------------\n");
-		if(old_entry->pa != 0)
-			kprintf("old entry->pa = %d\n",  old_entry->pa);
-			*/
-		if(old_entry->pa == cmap[index].pa)
-			break;
-		old_entry  = old_entry->next;
+
+	if(as->asid_gen == asid_generation){
+		for (i = 0; i < NUM_TLB; i++) {
+			TLB_Read(&ehi, &elo, i);
+			if ((elo & TLBLO_VALID) && (ehi & TLBHI_PID) >> TLBHI_PIDSHIFT == as->asid) {
+				TLB_Write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+			}
+		}
+		TLB_SetPID(cur_asid);
 	}
-	//kprintf("----------------------------------------------------------------------\n");
-	assert(old_entry != NULL);
-	old_entry->on_mem = 0;
-	old_entry->on_disk = 1;
-	old_entry->pa = 0;
 	splx(spl);
-	return old_entry;
 }
 
-paddr_t demand_page(struct pte *entry, struct addrspace *as){
-	//kprintf("demand page: entry = %x as = %x\n", entry, as);
-	assert (entry != NULL);
-	int spl = splhigh();
-	assert(vm_bootstrap_done == 1);
-	//lock_acquire(access_cmap);
-	paddr_t pa = 0;
-
-	if(pages_avail > 0){
-		pa = KVADDR_TO_PADDR(alloc_upages(1, as));	//allocate one page
-		if(pa == 0){
-			splx(spl);
-			//lock_release(access_cmap);
-			return ENOMEM;	//oops ran out of memory!!! :'(
-		}
-		entry->pa = pa;
-		entry->on_mem = 1;
-		//kprintf("U: %x alloc_u'ed a page %d\n", as, pa);
-	}
-	else{
-		//TODO: entry's va is the same as the faultaddress???
-		//TODO: we're not freeing all the pages
+/*
+	TLB fill. New entries go into the slot after the one filled last (round robin), which needs
+	no scan for a free slot and never throws out an entry that was just loaded.
+	If tlb_prefetch is set, each miss also loads up to that many resident pages following the
+	faulting one, so sequential scans take fewer misses. Counters for the "tlb" menu command:
+		tlb_misses		TLB miss faults (reads and writes)
+		tlb_modfaults	writes to pages entered read-only
+		tlb_fastfills	misses handled by the fast path
+		tlb_prefetched	entries loaded ahead of a miss
+*/
+static u_int32_t tlb_next;
+int tlb_prefetch;
+unsigned long tlb_misses, tlb_modfaults, tlb_fastfills, tlb_prefetched;
 
-		// Make space on RAM
-		unsigned long lru_index = find_lru();
-		unsigned long offset;
-		pa = cmap[lru_index].pa;
-		int evict = 1;
-		if(cmap[lru_index].state == clean) evict = EVICT_CLEAN;
-		else evict = EVICT_DIRTY;
-
-		struct pte *evicted_pte = update_pte(lru_index);
-
-		// get_space_on_disk must be called before updating cmap. That way, get_space_on_disk finds on of these:
-		//	1) the offset where this page used to be stored, if it happened to be stored on disk before
-		//	2) a new offset on disk where the page can be evicted to, if this page was never stored on disk before
-		// to do so, it must use the old addrspace that used to own that cmap entry
-		if(evict == 1)
-			offset = get_space_on_disk(lru_index, evicted_pte->va, SWAPOUT);
-		update_cmap(lru_index, as, dirty, user);	//updates the cmap with the new as
-		//update_cmap must be called before swap_out
-		if(evict == 1)
-			swap_out( offset, PADDR_TO_KVADDR(pa));
-		entry->pa = pa;
-		entry->on_mem = 1;
-		//kprintf("U: evicting %d\n", lru_index);
+/*
+	enters va -> pa for the current address space. Clean pages and pages still shared after a
+	fork are entered read-only, so the first write traps (EX_MOD) and vm_fault gets to see it
+*/
+static void tlb_load(vaddr_t va, paddr_t pa, int writable){
+	u_int32_t ehi, elo;
+	int i, spl = splhigh();
+
+	ehi = va | (cur_asid << TLBHI_PIDSHIFT);
+	elo = pa | TLBLO_VALID;
+	if(writable)
+		elo |= TLBLO_DIRTY;
+	DEBUG(DB_VM, "vm: 0x%x -> 0x%x\n", va, pa);
+
+	//a read-only fault (or a prefetched page) means there is an entry for this page already:
+	//replace it
+	i = TLB_Probe(ehi, 0);
+	if (i < 0) {
+		i = tlb_next;
+		tlb_next = (tlb_next + 1) % NUM_TLB;
 	}
-	assert((pa & PAGE_FRAME) == pa);
+	TLB_Write(ehi, elo, i);
+	TLB_SetPID(cur_asid);
 	splx(spl);
-	//lock_release(access_cmap);
-	return entry->pa;
 }
 
-paddr_t load_page(struct pte *entry, struct addrspace *as, int faulttype){
-	//kprintf("load page: entry = %x as = %x\n", entry, as);
-	assert (entry != NULL);
-	int spl = splhigh();
-	assert(vm_bootstrap_done == 1);
-	//lock_acquire(access_cmap);
-	paddr_t pa = 0;
-	unsigned long lru_index;
-	unsigned long evict_offset, swapin_offset;
-
-	if(pages_avail > 0){	//leave 5 pages for alloc_kpages?
-		pa = KVADDR_TO_PADDR(alloc_upages(1, as));	//allocate one page
-		if(pa == 0){
-			splx(spl);
-			//lock_release(access_cmap);
-			return ENOMEM;	//oops ran out of memory!!! :'(
-		}
-		lru_index = (pa - cmap_start_physaddr)/PAGE_SIZE;
-
-		//update cmap must first update the as that RAM page belongs to, so when we call get_space_on_disk
-		//we look for the offset where the page to be swapped in was soted on disk
-		update_cmap(lru_index, as, clean, user);
-		
-		//now get the offset where the page was stored on disk
-		swapin_offset = get_space_on_disk(lru_index, entry->va, SWAPIN);
-
+//writable in the TLB only if the region allows writes and the first write needs nothing done
+#define PAGE_WRITABLE(entry, index) (((entry)->rwx & PF_W) && cmap[index].refcount == 1 && cmap[index].state == dirty)
 
-		swap_in(swapin_offset, PADDR_TO_KVADDR(pa));
+/*
+	loads the resident pages right after va, up to tlb_prefetch of them
+*/
+static void tlb_prefetch_after(struct addrspace *as, vaddr_t va){
+	struct pte *entry;
+	unsigned long index;
+	int i;
 
-		assert(pa != 0);
-		entry->pa = pa;
-		entry->on_mem = 1;
+	if(tlb_prefetch > TLB_PREFETCH_MAX)
+		tlb_prefetch = TLB_PREFETCH_MAX;
+	for(i = 1; i <= tlb_prefetch; i++){
+		va += PAGE_SIZE;
+		if(va >= USERTOP)
+			break;
+		entry = pt_lookup(as, va, 0);
+		if(entry == NULL || !entry->on_mem)
+			break;
+		index = PADDR_TO_CMAP_INDEX(PTE_PA(entry));
+		cmap[index].referenced = 1;
+		tlb_load(va, PTE_PA(entry), PAGE_WRITABLE(entry, index));
+		tlb_prefetched++;
 	}
-	else{
-		//TODO: entry's va is the same as the faultaddress???
-		//TODO: we're not freeing all the pages
-
-		// Make space on RAM
-		lru_index = find_lru();
-		pa = cmap[lru_index].pa;
-		int evict = 1;
-		if(cmap[lru_index].state == clean) evict = EVICT_CLEAN;
-		else evict = EVICT_DIRTY;
+}
 
-		struct pte *evicted_pte = update_pte(lru_index);
+/*
+	a miss on a page of a superpage chunk loads the translation of every resident page of the
+	chunk as well, standing in for the one large TLB entry the r3000 doesn't have
+*/
+int vm_superpages;
+unsigned long vm_superfills, tlb_rangefills;
 
-		//evict_offset must be called before updating cmap. That way, get_space_on_disk finds on of these:
-		//	1) the offset where this page used to be stored, if it happened to be stored on disk before
-		//	2) a new offset on disk where the page can be evicted to, if this page was never stored on disk before
-		// to do so, it must use the old addrspace that used to own that cmap entry
-		if(evict == 1)
-			evict_offset = get_space_on_disk(lru_index, evicted_pte->va, SWAPOUT);
+static void tlb_load_range(struct addrspace *as, vaddr_t va){
+	vaddr_t base = va & ~(vaddr_t)(SUPERPAGE_SIZE - 1);
+	struct pte *entry;
+	unsigned long index;
 
-		//after this, the cmap entry belongs to the as that is trying to get space on disk
-		update_cmap(lru_index, as, dirty, user);
+	for(va = base; va < base + SUPERPAGE_SIZE; va += PAGE_SIZE){
+		entry = pt_lookup(as, va, 0);
+		if(entry == NULL || !entry->on_mem || !entry->super)
+			continue;
+		index = PADDR_TO_CMAP_INDEX(PTE_PA(entry));
+		cmap[index].referenced = 1;
+		tlb_load(va, PTE_PA(entry), PAGE_WRITABLE(entry, index));
+	}
+	tlb_rangefills++;
+}
 
-		// Fill space on RAM
-		//now that the cmap entry has the addrspace to be swapped in, look for it on disk
-		swapin_offset = get_space_on_disk(lru_index, entry->va, SWAPIN);
+/*
+	reads the page at disk offset (offset) into va. The caller keeps the frame busy: the coremap
+	lock is let go during the read. Returns 0 or the error from the disk
+*/
+int swap_in(unsigned long offset, vaddr_t va){
+	struct uio uio_swap;
+	int depth;
 
-		//update the cmap entry to be clean
+	mk_kuio(&uio_swap,(void *)(va & PAGE_FRAME), PAGE_SIZE, offset, UIO_READ);
 
-		if(faulttype == VM_FAULT_WRITE)
-			update_cmap(lru_index, as, dirty, user);
-		else
-			update_cmap(lru_index, as, clean, user);
+	vm_swap_ios++;
+	depth = cmap_io_begin();
+	int result=VOP_READ(swap_file, &uio_swap);
+	cmap_io_end(depth);
+	if(result)
+		kprintf("swap: read at offset %lu failed: %s\n", offset, strerror(result));
+	return result;
+}
 
-		if(evict == 1)
-			swap_out(evict_offset, PADDR_TO_KVADDR(pa));
-		swap_in(swapin_offset, PADDR_TO_KVADDR(pa));
 
-		assert(pa != 0);
-		entry->pa = pa;
-		entry->on_mem = 1;
+/*
+	every pte mapping the frame at coremap index: the owner in cmap[].as/va first, then the sharers
+	added by fork. fn is called with each one
+*/
+static void for_each_mapping(unsigned long index, void (*fn)(struct addrspace *, struct pte *, unsigned long, int), int arg){
+	struct cmap_sharer *sh;
+	struct pte *entry;
+
+	entry = pt_lookup(cmap[index].as, cmap[index].va, 0);
+	assert(entry != NULL && entry->on_mem && PTE_PA(entry) == cmap[index].pa);
+	fn(cmap[index].as, entry, index, arg);
+	for(sh = cmap[index].sharers; sh != NULL; sh = sh->next){
+		entry = pt_lookup(sh->as, sh->va, 0);
+		assert(entry != NULL && entry->on_mem && PTE_PA(entry) == cmap[index].pa);
+		fn(sh->as, entry, index, arg);
 	}
-	assert(entry->on_disk == 1);
-	assert((pa & PAGE_FRAME) == pa);
-
-	splx(spl);
-	//lock_release(access_cmap);
-	return entry->pa;	
 }
 
-void update_time(unsigned long index){
-	time_t s;
-	u_int32_t ns;
-	
-	gettime(&s, &ns);
-
-	cmap[index].s = s;
-	cmap[index].ns = ns;
+/*
+	points entry of as at the frame pa. Every pte that becomes resident goes through here, and
+	every one that stops being resident decrements as->rss, so rss is what as has mapped in RAM.
+	as->swapped is kept the same way for ptes in swap
+*/
+static void pte_map(struct addrspace *as, struct pte *entry, paddr_t pa){
+	if(entry->on_disk)
+		as->swapped--;
+	PTE_SET_PA(entry, pa);
+	entry->on_mem = 1;
+	entry->on_disk = 0;
+	as->rss++;
 }
 
-void update_cmap(unsigned long index, struct addrspace *as, cmap_state_t state, page_state_t pstate){
-	cmap[index].as = as;
-	cmap[index].state = state;
-	cmap[index].num_pages = 1;
-	cmap[index].first_page = 1;
-	cmap[index].p_state = pstate;
-	//kprintf("updating cmap of %d, belongs to as = %x\n", cmap[index].pa, cmap[index].as);
-	//kprintf("----------------------------------------------------------------------\n");
-	//kprintf("----------------------------------------------------------------------\n");
-	update_time(index);
+static void pte_to_disk(struct addrspace *as, struct pte *entry, unsigned long index, int slot){
+	(void)index;
+	entry->on_mem = 0;
+	entry->on_disk = 1;
+	entry->pfn = slot;
+	as->rss--;
+	as->swapped++;
 }
 
-int on_stack(vaddr_t faultaddress, struct addrspace *as){
-	if(faultaddress >= as->stack_begin && faultaddress < as->stack_end)
-		return 1;
-	return 0;
+static void pte_drop(struct addrspace *as, struct pte *entry, unsigned long index, int unused){
+	(void)index;
+	(void)unused;
+	entry->on_mem = 0;
+	entry->on_disk = 0;
+	entry->pfn = 0;
+	as->rss--;
 }
 
-int on_heap(vaddr_t faultaddress, struct addrspace *as){
-	if(faultaddress >= as->heap_begin && faultaddress < as->heap_end)
-		return 1;
-	return 0;
-}
+/*
+	evicts the user page at coremap index: writes it to its swap slot and points every pte that
+	maps it at the slot. The frame is left owned by nobody, ready to be handed out again.
+	A clean page is identical to its copy on disk and is not written. If it has no slot it
+	still holds what the executable (or the mapped file) has, so the ptes just forget it and
+	the next fault reads it from the file again. Returns ENOSPC, and leaves the page alone, if
+	it would need a slot and swap is full
+*/
+static int page_out(unsigned long index){
+	struct addrspace *as = cmap[index].as;
+	struct region_array *region;
+	struct cmap_sharer *sh;
+	int slot, i, write;
+
+	assert(cmap[index].as != NULL && cmap[index].refcount > 0);
+
+	//a page of a mapped file goes back to the file rather than to swap. We may sleep on the
+	//disk with the page still mapped, so keep at it until it stays clean. If the file can't
+	//take it the page goes to swap like any other
+	region = mapped_region(as, cmap[index].va);
+	if(region != NULL && cmap[index].state == dirty){
+		cmap[index].busy++;
+		while(cmap[index].state == dirty){
+			if(mmap_writeback(index, region)){
+				cmap[index].state = dirty;
+				break;
+			}
+		}
+		page_unbusy(index);
+	}
 
-int on_region_pages(vaddr_t faultaddress, struct addrspace *as){
-	if(faultaddress >= as->pages->va && faultaddress < (as->last_page->va + PAGE_SIZE))
-		return 1;
-	return 0;
-}
+	slot = cmap[index].swap_slot;
+	write = (cmap[index].state == dirty);
+	if(write && slot == NO_SLOT){
+		slot = swap_alloc();
+		if(slot == NO_SLOT)
+			return ENOSPC;
+	}
+
+	pcache_remove(index);
+	if(slot == NO_SLOT){
+		for_each_mapping(index, pte_drop, 0);
+	}
+	else{
+		assert(!write || smap[slot].refcount == 1);
+		//the frame's reference becomes the first pte's, every other mapping needs its own
+		for(i = 1; i < cmap[index].refcount; i++)
+			swap_ref(slot);
+
+		for_each_mapping(index, pte_to_disk, slot);
+	}
+
+	while(cmap[index].sharers != NULL){
+		sh = cmap[index].sharers;
+		cmap[index].sharers = sh->next;
+		kfree(sh);
+	}
+	cmap[index].as = NULL;
+	cmap[index].va = 0;
+	cmap[index].refcount = 0;
+	cmap[index].swap_slot = NO_SLOT;
+	user_pages--;
+
+	if(write){
+		vm_swap_writes++;
+		as->swapouts++;
+		swap_out(slot*PAGE_SIZE, PADDR_TO_KVADDR(cmap[index].pa));
+	}
+	else{
+		tlb_invalidate_pa(cmap[index].pa);
+	}
+	return 0;
+}
+
+/*
+	the first write to a clean page: its copy on disk is about to be stale. We hang on to the
+	slot to write the page back into, unless a fork left other ptes pointing at it
+*/
+static void page_dirty(unsigned long index){
+	int slot = cmap[index].swap_slot;
+
+	cmap[index].state = dirty;
+	if(slot != NO_SLOT && smap[slot].refcount > 1){
+		swap_unref(slot);
+		cmap[index].swap_slot = NO_SLOT;
+	}
+}
+
+/*
+	can the page at va of as go out in the same cluster as its predecessor? It has to be
+	resident, dirty, mapped by as alone and not part of a mapped file. Returns its coremap
+	index or page_count
+*/
+static unsigned long cluster_candidate(struct addrspace *as, vaddr_t va){
+	struct pte *entry;
+	unsigned long index;
+
+	if(va >= USERTOP)
+		return page_count;
+	entry = pt_lookup(as, va, 0);
+	if(entry == NULL || !entry->on_mem)
+		return page_count;
+	index = PADDR_TO_CMAP_INDEX(PTE_PA(entry));
+	if(!page_evictable(index) || cmap[index].state != dirty || cmap[index].refcount != 1)
+		return page_count;
+	if(mapped_region(as, va) != NULL)
+		return page_count;
+	return index;
+}
+
+/*
+	evicts the page at coremap index on its own and frees the frame. Returns 1, or 0 if it
+	couldn't go (see page_out)
+*/
+static int page_out_single(unsigned long index){
+	if(page_out(index))
+		return 0;
+	free_kpages(PADDR_TO_KVADDR(cmap[index].pa));
+	return 1;
+}
+
+/*
+	evicts the page at coremap index along with the dirty pages that follow it in its address
+	space, copying them into swap_cluster_buf and writing them into consecutive slots with one
+	request, so that load_page can read them back the same way. The frames are freed before
+	the write starts. Returns the number of pages freed
+*/
+static int page_out_cluster(unsigned long index){
+	unsigned long pages[SWAP_CLUSTER];
+	struct addrspace *as = cmap[index].as;
+	vaddr_t va = cmap[index].va;
+	int n, k, slot;
+
+	if(cluster_busy || cmap[index].state != dirty || cmap[index].refcount != 1 || mapped_region(as, va) != NULL)
+		return page_out_single(index);
+
+	pages[0] = index;
+	for(n = 1; n < SWAP_CLUSTER; n++){
+		pages[n] = cluster_candidate(as, va + n*PAGE_SIZE);
+		if(pages[n] == page_count)
+			break;
+	}
+
+	slot = (n > 1) ? swap_alloc_run(n) : NO_SLOT;
+	if(slot == NO_SLOT)
+		return page_out_single(index);
+
+	cluster_busy = 1;
+	for(k = 0; k < n; k++){
+		index = pages[k];
+		if(cmap[index].swap_slot != NO_SLOT)
+			swap_unref(cmap[index].swap_slot);	//dirty, so nobody else uses it
+		memmove((void *)(swap_cluster_buf + k*PAGE_SIZE),
+			(const void *)PADDR_TO_KVADDR(cmap[index].pa), PAGE_SIZE);
+		for_each_mapping(index, pte_to_disk, slot + k);
+		tlb_invalidate_pa(cmap[index].pa);
+
+		cmap[index].as = NULL;
+		cmap[index].va = 0;
+		cmap[index].refcount = 0;
+		cmap[index].swap_slot = NO_SLOT;
+		user_pages--;
+		free_kpages(PADDR_TO_KVADDR(cmap[index].pa));
+	}
+	vm_evictions += n - 1;		//find_victim counted the first one
+	vm_swap_writes += n;
+	as->swapouts += n;
+
+	cluster_wslot = slot;
+	cluster_wn = n;
+	swap_cluster_io(slot, n, UIO_WRITE);	//a failed write leaves the slots bad
+	cluster_wslot = NO_SLOT;
+	cluster_busy = 0;
+	return n;
+}
+
+/*
+	evict a page chosen by the replacement policy and return its coremap index. Once swap is
+	full a dirty victim can't go, so we keep asking for another until a clean one turns up.
+	Returns page_count if there is none, or nothing that can be evicted at all
+*/
+static unsigned long make_room(void){
+	unsigned long index, tries;
+
+	for(tries = 0; tries < page_count; tries++){
+		index = find_victim();
+		if(index == page_count)
+			break;
+		if(page_out(index) == 0)
+			return index;
+		vm_evictions--;		//find_victim counted it
+	}
+	return page_count;
+}
+
+/*
+	gets a frame for user page va of as, evicting something if RAM is full. The page is cleared
+	when zero is set. Returns its coremap index; the frame is mapped once, by nobody yet but the
+	caller's pte. Returns page_count if RAM and swap are both full
+*/
+static unsigned long alloc_frame(struct addrspace *as, vaddr_t va, cmap_state_t state, int zero){
+	unsigned long index = page_count;
+	int is_zero = 0;
+	vaddr_t kva;
+
+	if(zero && cmap_zerolist != NO_PAGE){
+		index = cmap_zerolist;
+		claim_run(index, 1, user, as);
+	}
+	else if(pages_avail > 0){
+		kva = alloc_upages(1, as);	//allocate one page
+		if(kva != 0)
+			index = PADDR_TO_CMAP_INDEX(KVADDR_TO_PADDR(kva));
+	}
+
+	if(index < page_count){
+		is_zero = cmap[index].zeroed;
+		cmap[index].state = state;
+	}
+	else{
+		// Make space on RAM
+		index = make_room();
+		if(index == page_count)
+			return page_count;
+		update_cmap(index, as, state, user);
+	}
+	cmap[index].zeroed = 0;
+
+	if(zero && !is_zero)
+		bzero((void *)PADDR_TO_KVADDR(cmap[index].pa), PAGE_SIZE);
+
+	cmap[index].va = va;
+	cmap[index].refcount = 1;
+	cmap[index].sharers = NULL;
+	cmap[index].swap_slot = NO_SLOT;
+	user_pages++;
+	return index;
+}
+
+/*
+	used by the pageout daemon: writes a page chosen by the replacement policy, and the pages
+	clustered with it, to swap and frees their frames. Returns how many pages were freed, 0 if
+	there is nothing left worth evicting
+*/
+int vm_pageout_one(void){
+	unsigned long index;
+	int n;
+
+	cmap_lock();
+
+	if(user_pages <= PAGEOUT_MIN_USER){
+		cmap_unlock();
+		return 0;
+	}
+	index = find_victim();
+	n = (index < page_count) ? page_out_cluster(index) : 0;
+	cmap_unlock();
+	return n;
+}
+
+/*
+	called by scheduler() on each pass of the idle loop: clears at most one free page and moves
+	it to the zeroed list. The loop takes interrupts before the next page
+*/
+void vm_idle_zero(void){
+	unsigned long index;
+	int spl = splhigh();
+
+	//we are in the scheduler and can't sleep on the coremap lock. Nobody else runs until we
+	//return, so all that matters is that nobody is in the middle of something
+	if(!vm_bootstrap_done || cmap_holder != NULL || cmap_zeroed_pages >= zero_target || cmap_freelist == NO_PAGE){
+		splx(spl);
+		return;
+	}
+	index = cmap_freelist;
+	bzero((void *)PADDR_TO_KVADDR(cmap[index].pa), PAGE_SIZE);
+	freelist_remove(index);
+	zerolist_add(index);
+	splx(spl);
+}
+
+/*
+	first touch of a zero-filled page. Returns 0 with *ret set to its frame, or ENOMEM
+*/
+int demand_page(struct pte *entry, struct addrspace *as, vaddr_t va, paddr_t *ret){
+	//kprintf("demand page: entry = %x as = %x\n", entry, as);
+	assert (entry != NULL);
+	cmap_lock();
+	assert(vm_bootstrap_done == 1);
+
+	unsigned long index = alloc_frame(as, va, dirty, 1);
+	if(index == page_count){
+		cmap_unlock();
+		return ENOMEM;
+	}
+
+	pte_map(as, entry, cmap[index].pa);
+
+	*ret = PTE_PA(entry);
+	cmap_unlock();
+	return 0;
+}
+
+/*
+	the page at va of as lives in slot, and the pages after it may have gone out in the same
+	cluster. If so, and there is free memory for them, read them all with one request. Returns
+	0 if the page is to be read on its own (or the read failed), 1 with *ret set to the faulting
+	page's frame otherwise
+*/
+static int swap_readahead(struct addrspace *as, vaddr_t va, int slot, paddr_t *ret){
+	struct pte *entry;
+	unsigned long index;
+	int n, k;
+
+	if(cluster_busy)
+		return 0;
+	for(n = 1; n < SWAP_CLUSTER && pages_avail > (unsigned long)n; n++){
+		if(va + n*PAGE_SIZE >= USERTOP)
+			break;
+		entry = pt_lookup(as, va + n*PAGE_SIZE, 0);
+		if(entry == NULL || entry->on_mem || !entry->on_disk || entry->pfn != (unsigned)(slot + n))
+			break;
+		if(smap[slot + n].writing || smap[slot + n].bad)
+			break;
+	}
+	if(n == 1)
+		return 0;
+
+	cluster_busy = 1;
+	if(swap_cluster_io(slot, n, UIO_READ)){
+		cluster_busy = 0;
+		return 0;
+	}
+
+	//the faulting page first, then whichever of the others are still waiting for it
+	for(k = 0; k < n; k++){
+		entry = pt_lookup(as, va + k*PAGE_SIZE, 0);
+		assert(entry != NULL);
+		if(entry->on_mem || !entry->on_disk || entry->pfn != (unsigned)(slot + k)){
+			assert(k > 0);
+			continue;
+		}
+		if(k > 0 && pages_avail == 0)
+			break;		//don't evict anything just to read ahead
+
+		index = alloc_frame(as, va + k*PAGE_SIZE, clean, 0);
+		if(index == page_count){
+			if(k == 0){
+				cluster_busy = 0;
+				return 0;	//load_page finds out for itself
+			}
+			break;
+		}
+		memmove((void *)PADDR_TO_KVADDR(cmap[index].pa),
+			(const void *)(swap_cluster_buf + k*PAGE_SIZE), PAGE_SIZE);
+		cmap[index].swap_slot = slot + k;
+
+		pte_map(as, entry, cmap[index].pa);
+		as->swapins++;
+		vm_swap_reads++;
+		if(k == 0)
+			*ret = cmap[index].pa;
+		else
+			cmap[index].referenced = 0;	//not used yet, first in line if we were wrong
+	}
+	cluster_busy = 0;
+	return 1;
+}
+
+/*
+	brings the page at va of as back from its swap slot. Returns 0 with *ret set to its frame,
+	ENOMEM if there is no frame for it, or EIO if the slot is bad or can't be read; the pte is
+	left pointing at the slot then
+*/
+int load_page(struct pte *entry, struct addrspace *as, vaddr_t va, paddr_t *ret){
+	//kprintf("load page: entry = %x as = %x\n", entry, as);
+	assert (entry != NULL);
+	cmap_lock();
+	assert(vm_bootstrap_done == 1);
+	assert(entry->on_disk == 1 && entry->on_mem == 0);
+
+	int slot = entry->pfn;
+	int result = 0;
+	paddr_t pa;
+
+	//the page may not have made it to the disk yet (a clustered write is copied from its buffer)
+	if(!CLUSTER_WRITING(slot))
+		swap_wait(slot);
+	if(smap[slot].bad){
+		cmap_unlock();
+		return EIO;
+	}
+
+	if(swap_readahead(as, va, slot, ret)){
+		cmap_unlock();
+		return 0;
+	}
+
+	unsigned long index = alloc_frame(as, va, clean, 0);
+	if(index == page_count){
+		cmap_unlock();
+		return ENOMEM;
+	}
+	pa = cmap[index].pa;
+
+	//nobody may evict the frame while we sleep on the disk
+	cmap[index].busy++;
+	if(CLUSTER_WRITING(slot)){
+		//still on its way to the disk
+		memmove((void *)PADDR_TO_KVADDR(pa),
+			(const void *)(swap_cluster_buf + (slot - cluster_wslot)*PAGE_SIZE), PAGE_SIZE);
+	}
+	else{
+		swap_wait(slot);
+		result = smap[slot].bad ? EIO : swap_in(slot*PAGE_SIZE, PADDR_TO_KVADDR(pa));
+	}
+	page_unbusy(index);
+
+	if(result){
+		//nobody has seen the frame yet: just give it back
+		cmap[index].as = NULL;
+		cmap[index].refcount = 0;
+		user_pages--;
+		free_kpages(PADDR_TO_KVADDR(pa));
+		cmap_unlock();
+		return EIO;
+	}
+
+	//the frame keeps the pte's reference: while the page stays clean it can be evicted
+	//without writing it again. vm_fault marks it dirty on the first write
+	cmap[index].swap_slot = slot;
+
+	pte_map(as, entry, pa);
+	as->swapins++;
+	vm_swap_reads++;
+
+	assert((pa & PAGE_FRAME) == pa);
+	*ret = pa;
+	cmap_unlock();
+	return 0;
+}
+
+/*
+	the part of the page at va that region's segment has in the executable, as [*lo, *hi).
+	Returns 0 if the region has no file contents on that page
+*/
+static int file_range(struct region_array *region, vaddr_t va, vaddr_t *lo, vaddr_t *hi){
+	if(region->vn == NULL)
+		return 0;
+	*lo = (va > region->file_va) ? va : region->file_va;
+	*hi = (va + PAGE_SIZE < region->file_va + region->filesize) ? va + PAGE_SIZE : region->file_va + region->filesize;
+	return *lo < *hi;
+}
+
+/*
+	returns 1 if some of the page at va has to be read from the executable
+*/
+static int file_backed(vaddr_t va, struct addrspace *as){
+	struct region_array *region;
+	vaddr_t lo, hi;
+
+	for(region = as->regions; region != NULL; region = region->next){
+		if(file_range(region, va, &lo, &hi))
+			return 1;
+	}
+	return 0;
+}
+
+/*
+	the mapped file region (see sys_mmap) whose file contents cover va, NULL if there is none.
+	The zero tail of a mapping past the end of the file is ordinary anonymous memory
+*/
+struct region_array *mapped_region(struct addrspace *as, vaddr_t va){
+	struct region_array *region;
+	vaddr_t lo, hi;
+
+	for(region = as->regions; region != NULL; region = region->next){
+		if(region->mapped && file_range(region, va & PAGE_FRAME, &lo, &hi))
+			return region;
+	}
+	return NULL;
+}
+
+/*
+	writes the resident page at coremap index back to region's file and marks it clean. The
+	TLB entry goes first, so a write that comes in while we sleep on the disk faults and
+	dirties the page again. A swap copy left over from an earlier failed writeback is stale
+	from now on. The caller keeps the frame busy. Returns 0 or the error from the write
+*/
+static int mmap_writeback(unsigned long index, struct region_array *region){
+	struct uio u;
+	vaddr_t va = cmap[index].va, lo, hi;
+	int result, depth;
+
+	assert(cmap[index].busy > 0 && cmap[index].refcount == 1);
+	if(!file_range(region, va, &lo, &hi))
+		panic("mmap_writeback: 0x%x is not in the file\n", va);
+
+	cmap[index].state = clean;
+	tlb_invalidate_pa(cmap[index].pa);
+	if(cmap[index].swap_slot != NO_SLOT){
+		swap_unref(cmap[index].swap_slot);
+		cmap[index].swap_slot = NO_SLOT;
+	}
+
+	mk_kuio(&u, (void *)(PADDR_TO_KVADDR(cmap[index].pa) + (lo - va)), hi - lo,
+		region->offset + (lo - region->file_va), UIO_WRITE);
+	depth = cmap_io_begin();
+	result = VOP_WRITE(region->vn, &u);
+	cmap_io_end(depth);
+	if(result == 0 && u.uio_resid != 0)
+		result = ENOSPC;
+	return result;
+}
+
+/*
+	writes every dirty resident page of the mapped region in [start, end) of as back to its
+	file (msync, munmap, fork and exit). The zero tail past the end of the file stays put. Pages dirtied again while we write are left dirty.
+	Returns 0 or the first error from a write
+*/
+int mmap_sync(struct addrspace *as, struct region_array *region, vaddr_t start, vaddr_t end){
+	struct pte *entry;
+	unsigned long index;
+	vaddr_t va;
+	int result = 0, err;
+
+	assert(region->mapped);
+	cmap_lock();
+	for(va = start & PAGE_FRAME; va < end; va += PAGE_SIZE){
+		entry = pt_lookup(as, va, 0);
+		if(entry == NULL || !entry->on_mem || mapped_region(as, va) != region)
+			continue;
+		index = PADDR_TO_CMAP_INDEX(PTE_PA(entry));
+		if(cmap[index].state != dirty)
+			continue;
+
+		cmap[index].busy++;
+		err = mmap_writeback(index, region);
+		if(err){
+			cmap[index].state = dirty;
+			if(result == 0)
+				result = err;
+		}
+		page_unbusy(index);
+	}
+	cmap_unlock();
+	return result;
+}
+
+/*
+	first touch of a page that comes (at least partly) from the executable: read it in, the
+	rest of the page is zero. The page starts out clean without a swap slot, so if it is evicted
+	before anybody writes to it, it is dropped rather than written to swap. Returns 0 or an
+	error from the read, in which case the pte is left untouched
+*/
+static int file_page(struct pte *entry, struct addrspace *as, vaddr_t va, paddr_t *ret){
+	struct region_array *region;
+	struct uio u;
+	vaddr_t lo, hi, kva;
+	int whole = 0, result = 0, depth;
+	unsigned long index;
+
+	for(region = as->regions; region != NULL; region = region->next){
+		if(file_range(region, va, &lo, &hi) && lo == va && hi == va + PAGE_SIZE)
+			whole = 1;
+	}
+
+	index = alloc_frame(as, va, clean, !whole);
+	if(index == page_count)
+		return ENOMEM;
+	kva = PADDR_TO_KVADDR(cmap[index].pa);
+
+	//nobody may evict the frame while we sleep on the disk, and nobody else changes our regions
+	cmap[index].busy++;
+	depth = cmap_io_begin();
+	for(region = as->regions; region != NULL && result == 0; region = region->next){
+		if(!file_range(region, va, &lo, &hi))
+			continue;
+		mk_kuio(&u, (void *)(kva + (lo - va)), hi - lo, region->offset + (lo - region->file_va), UIO_READ);
+		result = VOP_READ(region->vn, &u);
+		if(result == 0 && u.uio_resid != 0){
+			kprintf("ELF: short read on page 0x%x - file truncated?\n", va);
+			result = ENOEXEC;
+		}
+	}
+	cmap_io_end(depth);
+	page_unbusy(index);
+
+	pte_map(as, entry, cmap[index].pa);
+
+	if(result){
+		page_release(as, va, entry);
+		return result;
+	}
+	*ret = cmap[index].pa;
+	return 0;
+}
+
+/*
+	can the aligned chunk at base be a superpage? It has to lie inside the heap or inside one
+	region marked super, and none of it may come from the executable
+*/
+static int super_eligible(struct addrspace *as, vaddr_t base){
+	struct region_array *region;
+	vaddr_t end = base + SUPERPAGE_SIZE, va, lo, hi;
+
+	if(!as->superpages)
+		return 0;
+	if(base >= as->heap_begin && end <= as->heap_end)
+		return 1;
+	for(region = as->regions; region != NULL; region = region->next){
+		if(!region->super || base < region->va || end > region->va + region->num_pages*PAGE_SIZE)
+			continue;
+		for(va = base; va < end; va += PAGE_SIZE){
+			if(file_range(region, va, &lo, &hi))
+				return 0;
+		}
+		return 1;
+	}
+	return 0;
+}
+
+/*
+	first touch of a zero-filled page, with the coremap lock held: maps the whole aligned
+	16-page chunk holding va to a free run of zeroed frames, if none of the chunk is in memory
+	or swap yet. Returns 1 with *ret set to va's frame, or 0 (nothing is evicted to make a run)
+	so the page goes through demand_page instead
+*/
+static int super_fill(struct pte *entry, struct addrspace *as, vaddr_t va, paddr_t *ret){
+	vaddr_t base = va & ~(vaddr_t)(SUPERPAGE_SIZE - 1);
+	struct pte *chunk[SUPERPAGE_PAGES];
+	unsigned long i, index;
+	int k;
+
+	if(pages_avail < 2*SUPERPAGE_PAGES || !super_eligible(as, base))
+		return 0;
+	//the chunk is aligned, so all its ptes are in the same level 2 table as entry
+	for(k = 0; k < SUPERPAGE_PAGES; k++){
+		chunk[k] = pt_lookup(as, base + k*PAGE_SIZE, 0);
+		assert(chunk[k] != NULL);
+		if(chunk[k]->on_mem || chunk[k]->on_disk)
+			return 0;
+	}
+	i = find_free_run(SUPERPAGE_PAGES);
+	if(i >= page_count)
+		return 0;
+
+	claim_run(i, SUPERPAGE_PAGES, user, as);
+	for(k = 0; k < SUPERPAGE_PAGES; k++){
+		//every frame is a page of its own from here on: evicted, shared and freed by itself
+		index = i + k;
+		cmap[index].num_pages = 1;
+		cmap[index].first_page = 1;
+		cmap[index].va = base + k*PAGE_SIZE;
+		cmap[index].refcount = 1;
+		if(!cmap[index].zeroed)
+			bzero((void *)PADDR_TO_KVADDR(cmap[index].pa), PAGE_SIZE);
+		cmap[index].zeroed = 0;
+		if(cmap[index].va != va)
+			cmap[index].referenced = 0;		//not used yet
+		user_pages++;
+
+		chunk[k]->rwx = entry->rwx;
+		chunk[k]->super = 1;
+		pte_map(as, chunk[k], cmap[index].pa);
+	}
+	vm_superfills++;
+	*ret = PTE_PA(entry);
+	return 1;
+}
+
+static void add_sharer(unsigned long index, struct cmap_sharer *sh, struct addrspace *as, vaddr_t va){
+	sh->as = as;
+	sh->va = va;
+	sh->next = cmap[index].sharers;
+	cmap[index].sharers = sh;
+	cmap[index].refcount++;
+}
+
+/*
+	the vnode a page is read from if it belongs to a read-only segment, which makes it the
+	same in every process running that executable. NULL otherwise
+*/
+static struct vnode *text_vnode(struct pte *entry, vaddr_t va, struct addrspace *as){
+	struct region_array *region;
+
+	if(entry->rwx & PF_W)
+		return NULL;
+	for(region = as->regions; region != NULL; region = region->next){
+		if(va >= region->va && va < region->va + region->num_pages*PAGE_SIZE)
+			return region->mapped ? NULL : region->vn;
+	}
+	return NULL;
+}
+
+/*
+	maps the frame another process already has for text page va of vn, if there is one.
+	Returns 0 if the page has to be read in
+*/
+static int cached_page(struct pte *entry, struct addrspace *as, vaddr_t va, struct vnode *vn, paddr_t *ret){
+	struct cmap_sharer *sh;
+	int index;
+
+	if(pcache_lookup(vn, va) == NO_PAGE)
+		return 0;
+	sh = kmalloc(sizeof(struct cmap_sharer));
+	if(sh == NULL)
+		return 0;
+	//kmalloc may have had to evict it
+	index = pcache_lookup(vn, va);
+	if(index == NO_PAGE){
+		kfree(sh);
+		return 0;
+	}
+	add_sharer(index, sh, as, va);
+
+	pte_map(as, entry, cmap[index].pa);
+	*ret = cmap[index].pa;
+	return 1;
+}
+
+/*
+	makes the pte of (as, va) a second mapping of the frame old already maps. Used by as_copy
+	to share the parent's pages copy-on-write. Returns ENOMEM if the sharer record can't be had
+*/
+int page_share(struct pte *old, struct pte *new, struct addrspace *as, vaddr_t va){
+	struct cmap_sharer *sh;
+	cmap_lock();
+
+	if(old->on_mem){
+		sh = kmalloc(sizeof(struct cmap_sharer));
+		if(sh == NULL){
+			cmap_unlock();
+			return ENOMEM;
+		}
+		//kmalloc may have had to evict the very page we are sharing
+		if(old->on_mem){
+			add_sharer(PADDR_TO_CMAP_INDEX(PTE_PA(old)), sh, as, va);
+			*new = *old;
+			as->rss++;
+			cmap_unlock();
+			return 0;
+		}
+		kfree(sh);
+	}
+
+	if(old->on_disk){
+		swap_ref(old->pfn);
+		*new = *old;
+		as->swapped++;
+	}
+	//else it was a text page that got dropped: the child reads it from the file like we will
+	cmap_unlock();
+	return 0;
+}
+
+/*
+	drops the mapping of va in as: the frame it maps loses a reference (and is freed with the last
+	one), or the swap slot it lives in does. The pte is cleared
+*/
+void page_release(struct addrspace *as, vaddr_t va, struct pte *entry){
+	struct cmap_sharer **shp, *sh;
+	unsigned long index;
+	cmap_lock();
+
+	//the last mapping can't go while the page is being written back to its file: wait, and
+	//look again, since page_out may have evicted it in the meantime
+	while(entry->on_mem){
+		index = PADDR_TO_CMAP_INDEX(PTE_PA(entry));
+		if(cmap[index].busy == 0 || cmap[index].refcount > 1)
+			break;
+		cmap_sleep(&cmap[index]);
+	}
+
+	if(entry->on_mem){
+		index = PADDR_TO_CMAP_INDEX(PTE_PA(entry));
+		assert(cmap[index].refcount > 0);
+		as->rss--;
+
+		if(cmap[index].as == as && cmap[index].va == va){
+			//the owner goes away: promote a sharer, if there is one
+			sh = cmap[index].sharers;
+			if(sh != NULL){
+				cmap[index].as = sh->as;
+				cmap[index].va = sh->va;
+				cmap[index].sharers = sh->next;
+				kfree(sh);
+			}
+		}
+		else{
+			for(shp = &cmap[index].sharers; *shp != NULL; shp = &(*shp)->next){
+				if((*shp)->as == as && (*shp)->va == va)
+					break;
+			}
+			assert(*shp != NULL);
+			sh = *shp;
+			*shp = sh->next;
+			kfree(sh);
+		}
+
+		cmap[index].refcount--;
+		if(cmap[index].refcount > 0){
+			//the frame stays, only our translation of it has to go
+			tlb_invalidate_va(as, va);
+		}
+		else{
+			pcache_remove(index);
+			tlb_invalidate_pa(cmap[index].pa);
+			if(cmap[index].swap_slot != NO_SLOT)
+				swap_unref(cmap[index].swap_slot);
+			cmap[index].swap_slot = NO_SLOT;
+			user_pages--;
+			free_kpages(PADDR_TO_KVADDR(cmap[index].pa));
+		}
+	}
+	else if(entry->on_disk){
+		swap_unref(entry->pfn);
+		as->swapped--;
+	}
+	bzero(entry, sizeof(struct pte));
+	cmap_unlock();
+}
+
+/*
+	releases every page of as, resident or swapped, by walking its page table
+*/
+void free_all_pages(struct addrspace *as){
+	unsigned i, j;
+	cmap_lock();
+
+	for(i = 0; i < PT_L1_ENTRIES; i++){
+		if(as->pt[i] == NULL)
+			continue;
+		for(j = 0; j < PT_L2_ENTRIES; j++){
+			if(as->pt[i][j].on_mem || as->pt[i][j].on_disk)
+				page_release(as, PT_VADDR(i, j), &as->pt[i][j]);
+		}
+	}
+	cmap_unlock();
+}
+
+/*
+	a write to a page that is still shared since fork: give (as, va) a private copy. The shared
+	frame stays put for its other users. Returns the copy's frame, or 0 if there is no memory
+	for it
+*/
+static paddr_t cow_break(struct pte *entry, struct addrspace *as, vaddr_t va){
+	unsigned long old_index = PADDR_TO_CMAP_INDEX(PTE_PA(entry));
+	unsigned long new_index;
+	struct pte copy;
+
+	assert(cmap[old_index].refcount > 1);
+
+	//keep the shared frame resident while we get a frame for the copy
+	cmap[old_index].busy++;
+	new_index = alloc_frame(as, va, dirty, 0);
+	page_unbusy(old_index);
+	if(new_index == page_count)
+		return 0;
+
+	memmove((void *)PADDR_TO_KVADDR(cmap[new_index].pa),
+		(const void *)PADDR_TO_KVADDR(cmap[old_index].pa), PAGE_SIZE);
+
+	//drop our mapping of the shared frame (and its TLB entry) and point the pte at the copy
+	copy = *entry;
+	page_release(as, va, entry);
+	*entry = copy;
+	pte_map(as, entry, cmap[new_index].pa);
+	return cmap[new_index].pa;
+}
+
+void update_time(unsigned long index){
+	time_t s;
+	u_int32_t ns;
+	
+	gettime(&s, &ns);
+
+	cmap[index].s = s;
+	cmap[index].ns = ns;
+}
+
+void update_cmap(unsigned long index, struct addrspace *as, cmap_state_t state, page_state_t pstate){
+	cmap[index].as = as;
+	cmap[index].state = state;
+	cmap[index].num_pages = 1;
+	cmap[index].first_page = 1;
+	cmap[index].p_state = pstate;
+	cmap[index].referenced = 1;
+	cmap[index].last_used = vm_vtime;
+	//kprintf("updating cmap of %d, belongs to as = %x\n", cmap[index].pa, cmap[index].as);
+	//kprintf("----------------------------------------------------------------------\n");
+	//kprintf("----------------------------------------------------------------------\n");
+	update_time(index);
+}
+
+int on_stack(vaddr_t faultaddress, struct addrspace *as){
+	if(faultaddress >= as->stack_begin && faultaddress < as->stack_end)
+		return 1;
+	return 0;
+}
+
+int on_heap(vaddr_t faultaddress, struct addrspace *as){
+	if(faultaddress >= as->heap_begin && faultaddress < as->heap_end)
+		return 1;
+	return 0;
+}
+
+/*
+	returns the rwx of the region faultaddress falls in, or 0 if it is not in any region
+*/
+int on_region_pages(vaddr_t faultaddress, struct addrspace *as){
+	struct region_array *region;
+	for(region = as->regions; region != NULL; region = region->next){
+		if(faultaddress >= region->va && faultaddress < region->va + region->num_pages*PAGE_SIZE)
+			return region->rwx;
+	}
+	return 0;
+}
 
 
 struct pte *find_entry_on_mem(vaddr_t faultaddress, struct addrspace *as){
@@ -601,116 +1826,221 @@ struct pte *find_entry_on_mem(vaddr_t faultaddress, struct addrspace *as){
 
 	// Assert that the address space has been set up properly. 
 
-	assert(as->pages != NULL);
-	assert(as->last_page != NULL);
-	assert(as->stack != NULL);
-	assert(as->last_stack != NULL);
-	assert(as->heap != NULL);
-	assert(as->heap_begin != 0);
-	assert(as->heap_end != 0);
+	assert(as->pt != NULL);
 	assert(as->regions != NULL);
 	assert(as->last_region != NULL);
-	assert((as->pages->va & PAGE_FRAME) == as->pages->va);
-	assert((as->pages->pa & PAGE_FRAME) == as->pages->pa);
-	assert((as->regions->pa & PAGE_FRAME) == as->regions->pa);
-	assert((as->regions->pa & PAGE_FRAME) == as->regions->pa);
-	assert(faultaddress <= MIPS_KSEG0);
+	assert(as->heap_begin != 0);
+	assert(as->stack_begin != 0);
+	assert((as->regions->va & PAGE_FRAME) == as->regions->va);
 
-	struct pte* entry;
+	if(faultaddress >= MIPS_KSEG0)
+		return NULL;
 
-	if(on_stack(faultaddress, as)){
-		entry = as->stack;
-		while(entry != NULL){	//search for the address in each of the stack pages
-			if((faultaddress >= entry->va) && faultaddress < (entry->va + PAGE_SIZE))break;
-			entry = entry->next;
-		}
+	int rwx;
+	if(on_stack(faultaddress, as) || on_heap(faultaddress, as)){
+		rwx = PF_R | PF_W;
 	}
-	else if(on_heap(faultaddress, as)){
-		entry = as->heap;
-		while(entry != NULL){	//search for the address in each of the stack pages
-			if((faultaddress >= entry->va) && faultaddress < (entry->va + PAGE_SIZE))break;
-			entry = entry->next;
-		}
-	}
-	else if(on_region_pages(faultaddress, as)){
-		entry = as->pages;
-		while(entry != NULL){	//search for the address in each of the stack pages
-			if((faultaddress >= entry->va) && faultaddress < (entry->va + PAGE_SIZE))break;
-			entry = entry->next;   
-		}
+	else{
+		rwx = on_region_pages(faultaddress, as);
+		if(rwx == 0)
+			return NULL;
 	}
-	else {
+
+	struct pte *entry = pt_lookup(as, faultaddress, 1);
+	if(entry == NULL)
 		return NULL;
-	}
-	assert(entry->va == faultaddress);
+	if(!entry->on_mem && !entry->on_disk)
+		entry->rwx = rwx;	//first touch of this page
 	return entry;
 }
 
-int vm_fault(int faulttype, vaddr_t faultaddress)
+static int handle_fault(int faulttype, vaddr_t faultaddress)
 {
-	int spl = splhigh();
+	cmap_lock();
 
 	faultaddress &= PAGE_FRAME;
 
-	DEBUG(DB_VM, "dumbvm: fault: 0x%x\n", faultaddress);
+	DEBUG(DB_VM, "vm: fault: 0x%x\n", faultaddress);
 
 	switch (faulttype) {
 	    case VM_FAULT_READONLY:
-		//We always create pages read-write, so we can't get this 
-		panic("dumbvm: got VM_FAULT_READONLY\n");
+		//a write to a page we mapped read-only because it is shared copy-on-write or clean
 	    case VM_FAULT_READ:
 	    case VM_FAULT_WRITE:
 		break;
 	    default:
-		splx(spl);
+		cmap_unlock();
 		return EINVAL;
 	}
 
 	struct addrspace *as = curthread->t_vmspace;
 	struct pte* entry;
+	unsigned long index;
+
+	//fast path: a plain TLB miss on a page that is resident and needs nothing done to it
+	if(faulttype != VM_FAULT_READONLY && as != NULL && faultaddress < USERTOP){
+		entry = pt_lookup(as, faultaddress, 0);
+		if(entry != NULL && entry->on_mem){
+			//text and read-only data may not be written to, here any more than below
+			if(faulttype == VM_FAULT_WRITE && !(entry->rwx & PF_W)){
+				tlb_misses++;
+				cmap_unlock();
+				return EFAULT;
+			}
+			index = PADDR_TO_CMAP_INDEX(PTE_PA(entry));
+			if(faulttype == VM_FAULT_READ || PAGE_WRITABLE(entry, index)){
+				tlb_misses++;
+				tlb_fastfills++;
+				vm_vtime++;
+				cmap[index].referenced = 1;
+				tlb_load(faultaddress, PTE_PA(entry), PAGE_WRITABLE(entry, index));
+				if(entry->super)
+					tlb_load_range(as, faultaddress);
+				else
+					tlb_prefetch_after(as, faultaddress);
+				as->minflt++;
+				vm_minflt++;
+				cmap_unlock();
+				return 0;
+			}
+		}
+	}
+
+	if(faulttype == VM_FAULT_READONLY)
+		tlb_modfaults++;
+	else
+		tlb_misses++;
 
 	entry = find_entry_on_mem(faultaddress, as);
 	if(entry == NULL){
-		splx(spl);
+		cmap_unlock();
+		return EFAULT;
+	}
+
+	//text and read-only data may not be written to
+	if(faulttype != VM_FAULT_READ && !(entry->rwx & PF_W)){
+		cmap_unlock();
 		return EFAULT;
 	}
 
-	paddr_t pa = entry->pa;
+	paddr_t pa = PTE_PA(entry);
+	int major = 0, result = 0;
 
 	if(entry->on_mem == 0){
-		//assert((pa == 0) || (pa == 0xdeadbeef));
 		if(entry->on_disk == 1){
-			pa = load_page(entry, as, faulttype);
+			result = load_page(entry, as, faultaddress, &pa);
+			major = 1;
 		}
-		else{
-			pa = demand_page(entry, as);
+		else if(file_backed(faultaddress, as)){
+			struct vnode *text = text_vnode(entry, faultaddress, as);
+			if(text == NULL || !cached_page(entry, as, faultaddress, text, &pa)){
+				result = file_page(entry, as, faultaddress, &pa);
+				if(result == 0 && text != NULL)
+					pcache_insert(PADDR_TO_CMAP_INDEX(pa), text);
+				major = 1;
+			}
+		}
+		else if(!super_fill(entry, as, faultaddress, &pa)){
+			result = demand_page(entry, as, faultaddress, &pa);
 		}
-	}
 
+		if(result){
+			cmap_unlock();
+			return result;
+		}
+	}
 
 	assert(pa != 0);
 
 	// make sure it's page-aligned 
 	assert((pa & PAGE_FRAME)==pa);
 
-	u_int32_t ehi, elo;
-	int i;
-	for (i = 0; i < NUM_TLB; i++) {
-		TLB_Read(&ehi, &elo, i);
-		if (elo & TLBLO_VALID) {
-			continue;
+	index = PADDR_TO_CMAP_INDEX(pa);
+	if(faulttype != VM_FAULT_READ){
+		if(cmap[index].refcount > 1){
+			pa = cow_break(entry, as, faultaddress);
+			if(pa == 0){
+				cmap_unlock();
+				return ENOMEM;
+			}
+			index = PADDR_TO_CMAP_INDEX(pa);
+		}
+		else if(cmap[index].state == clean){
+			page_dirty(index);
 		}
-		ehi = faultaddress;
-		elo = pa | TLBLO_DIRTY | TLBLO_VALID;
-		DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, pa);
-		TLB_Write(ehi, elo, i);
-		splx(spl);
-		return 0;
 	}
 
-	ehi = faultaddress;
-	elo = pa | TLBLO_DIRTY | TLBLO_VALID;
-	TLB_Random(ehi, elo);
-	splx(spl);
+	//the page is about to be reachable through the TLB again: give it its second chance
+	vm_vtime++;
+	cmap[index].referenced = 1;
+
+	tlb_load(faultaddress, pa, PAGE_WRITABLE(entry, index));
+	if(faulttype != VM_FAULT_READONLY){
+		if(entry->super)
+			tlb_load_range(as, faultaddress);
+		else
+			tlb_prefetch_after(as, faultaddress);
+	}
+
+	if(major){
+		as->majflt++;
+		vm_majflt++;
+	}
+	else{
+		as->minflt++;
+		vm_minflt++;
+	}
+	cmap_unlock();
 	return 0;
 }
+
+/*
+	called by the trap code. A fault that finds RAM and swap full asks the OOM killer for room
+	and tries again. If the faulting process is the one that has to go, or nothing comes free,
+	the fault fails and the trap code kills the process
+*/
+int vm_fault(int faulttype, vaddr_t faultaddress)
+{
+	int result, tries;
+
+	for(tries = 0; ; tries++){
+		result = handle_fault(faulttype, faultaddress);
+		if(result != ENOMEM || tries == OOM_RETRIES || !oom_kill())
+			return result;
+	}
+}
+
+/*
+	the counters reported by sys_vmstat and the vms menu command
+*/
+void vm_getstat(struct addrspace *as, struct vmstat *vs){
+	int spl = splhigh();
+
+	bzero(vs, sizeof(struct vmstat));
+	if(as != NULL){
+		vs->vs_rss = as->rss;
+		vs->vs_minflt = as->minflt;
+		vs->vs_majflt = as->majflt;
+		vs->vs_swapin = as->swapins;
+		vs->vs_swapout = as->swapouts;
+		vs->vs_swapped = as->swapped;
+		vs->vs_reserved = as->reserved;
+	}
+
+	vs->vs_pages = page_count;
+	vs->vs_free = pages_avail;
+	vs->vs_user = user_pages;
+	vs->vs_swap = smap_page_count;
+	vs->vs_swapfree = smap_pages_avail;
+	vs->vs_tminflt = vm_minflt;
+	vs->vs_tmajflt = vm_majflt;
+	vs->vs_tswapin = vm_swap_reads;
+	vs->vs_tswapout = vm_swap_writes;
+	vs->vs_swapios = vm_swap_ios;
+	vs->vs_evictions = vm_evictions;
+	vs->vs_tlbmisses = tlb_misses;
+	vs->vs_committed = vm_committed;
+	vs->vs_commitlimit = vm_commit_limit;
+	vs->vs_oomkills = vm_oom_kills;
+	splx(spl);
+}
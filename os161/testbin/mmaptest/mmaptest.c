@@ -0,0 +1,65 @@
+/*
+ * mmaptest.c
+ *
+ *	Checks what mmap will and won't map. The program maps its own
+ *	executable read-only and checks the ELF magic number at the
+ *	start of it, then tries to map the raw disks, starting with
+ *	lhd0raw: (the swap disk). Devices can't be mapped, so each of
+ *	those must fail with ENODEV.
+ *
+ *	Usage: mmaptest
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+#include <err.h>
+#include <sys/mman.h>
+
+#define PageSize	4096
+
+static const char *devices[] = {
+	"lhd0raw:",
+	"lhd1raw:",
+	NULL
+};
+
+int
+main(void)
+{
+	const char *self = "/testbin/mmaptest";
+	unsigned char *p;
+	void *q;
+	int i, bad = 0;
+
+	p = mmap(self, PageSize, PROT_READ, 0);
+	if (p == MAP_FAILED) {
+		err(1, "mmap %s", self);
+	}
+	if (p[0] != 0x7f || p[1] != 'E' || p[2] != 'L' || p[3] != 'F') {
+		warnx("%s: mapped page doesn't start with the ELF magic", self);
+		bad = 1;
+	}
+	if (munmap(p, PageSize)) {
+		err(1, "munmap %s", self);
+	}
+
+	for (i = 0; devices[i] != NULL; i++) {
+		q = mmap(devices[i], PageSize, PROT_READ|PROT_WRITE, 0);
+		if (q != MAP_FAILED) {
+			warnx("mmap %s succeeded", devices[i]);
+			munmap(q, PageSize);
+			bad = 1;
+		}
+		else if (errno != ENODEV) {
+			warn("mmap %s failed, but not with ENODEV", devices[i]);
+			bad = 1;
+		}
+	}
+
+	if (bad) {
+		errx(1, "FAILED");
+	}
+	printf("mmaptest: passed\n");
+	return 0;
+}
@@ -0,0 +1,15 @@
+
+tlbsweep.o: \
+ tlbsweep.c \
+ $(OSTREE)/include/unistd.h \
+ $(OSTREE)/include/sys/types.h \
+ $(OSTREE)/include/machine/types.h \
+ $(OSTREE)/include/kern/types.h \
+ $(OSTREE)/include/kern/unistd.h \
+ $(OSTREE)/include/kern/ioctl.h \
+ $(OSTREE)/include/stdio.h \
+ $(OSTREE)/include/stdarg.h \
+ $(OSTREE)/include/stdlib.h \
+ $(OSTREE)/include/err.h \
+ $(OSTREE)/include/sys/vmstat.h \
+ $(OSTREE)/include/kern/vmstat.h
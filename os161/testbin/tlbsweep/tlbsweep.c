@@ -0,0 +1,84 @@
+/*
+ * tlbsweep.c
+ *
+ *	Measures TLB misses while sweeping large arrays, to compare
+ *	runs with superpages off and on (kernel menu command "sp").
+ *
+ *	One array is in the bss, the other is obtained with sbrk. Each
+ *	is swept page by page, then in a stride that touches a
+ *	different page on every access. The TLB misses and faults taken
+ *	by each sweep are read with vmstat().
+ *
+ *	Usage: tlbsweep [passes]
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <err.h>
+#include <sys/vmstat.h>
+
+#define PageSize	4096
+#define ArrayPages	128	/* 512K each: far more than the TLB maps */
+#define ArrayInts	(ArrayPages * PageSize / sizeof(int))
+#define Align		(16 * PageSize)	/* superpage size */
+
+int bss_array[ArrayInts];
+
+static
+void
+sweep(const char *name, int *array, int passes)
+{
+	struct vmstat before, after;
+	unsigned i, p;
+	int sum = 0;
+
+	if (vmstat(&before)) {
+		err(1, "vmstat");
+	}
+
+	for (p = 0; p < (unsigned)passes; p++) {
+		/* sequential, one access per page */
+		for (i = 0; i < ArrayInts; i += PageSize / sizeof(int)) {
+			array[i] += p;
+		}
+		/* strided: every access lands on another page */
+		for (i = 0; i < ArrayInts; i += PageSize / sizeof(int) + 1) {
+			sum += array[i];
+		}
+	}
+
+	if (vmstat(&after)) {
+		err(1, "vmstat");
+	}
+
+	printf("%-6s %8u TLB misses, %6u minor, %6u major faults "
+	       "(checksum %d)\n", name,
+	       after.vs_tlbmisses - before.vs_tlbmisses,
+	       after.vs_minflt - before.vs_minflt,
+	       after.vs_majflt - before.vs_majflt, sum);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int passes = 4;
+	int *heap_array;
+
+	if (argc > 1) {
+		passes = atoi(argv[1]);
+	}
+
+	/* start the array on a 64K boundary so all of it can be mapped big */
+	heap_array = sbrk(0);
+	sbrk((Align - (unsigned)heap_array % Align) % Align);
+	heap_array = sbrk(ArrayPages * PageSize);
+	if (heap_array == (void *)-1) {
+		err(1, "sbrk");
+	}
+
+	printf("tlbsweep: %d passes over %d pages\n", passes, ArrayPages);
+	sweep("bss", bss_array, passes);
+	sweep("heap", heap_array, passes);
+	return 0;
+}